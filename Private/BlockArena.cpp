@@ -0,0 +1,121 @@
+#include "BlockArena.h"
+#include "VirtualMemory.h"
+#include "ObjectStatics.h"
+
+#include <thread>
+
+BlockArena& BlockArena::Get() {
+    return GetNeverDestroyed<BlockArena>();
+}
+
+BlockArena::BlockArena() {
+    // Over-reserve so the start can be aligned for huge pages
+    for (u64 size = MaxReservationSize; size >= MinReservationSize; size /= 2) {
+        u8* reservation = (u8*) ReserveVirtualMemory(size + HugePageSize);
+        if (reservation) {
+            Base = (u8*)(((uintptr_t) reservation + HugePageSize - 1) & ~(uintptr_t)(HugePageSize - 1));
+            ReservedSize = size;
+            break;
+        }
+    }
+
+    BlockStarts = Array<std::atomic<u64>>((ReservedSize / UnitSize + 63) / 64);
+}
+
+u8* BlockArena::Allocate(u64 size, const bool useHugePages) {
+    size = (size + UnitSize - 1) & ~(UnitSize - 1);
+
+    std::lock_guard lock(Mutex);
+    const u64 usedSize = UsedSize.load(std::memory_order_relaxed);
+    if (!Base || size > ReservedSize - usedSize) {
+        return nullptr;
+    }
+
+    u8* memory = Base + usedSize;
+    if (!CommitVirtualMemory(memory, size)) {
+        return nullptr;
+    }
+    UsedSize.store(usedSize + size, std::memory_order_release);
+    CommittedSize += size;
+
+    if (useHugePages) {
+        u8* hugePagesBegin = (u8*)(((uintptr_t) memory + HugePageSize - 1) & ~(uintptr_t)(HugePageSize - 1));
+        u8* hugePagesEnd = (u8*)((uintptr_t)(memory + size) & ~(uintptr_t)(HugePageSize - 1));
+        if (hugePagesBegin < hugePagesEnd) {
+            AdviseHugePages(hugePagesBegin, hugePagesEnd - hugePagesBegin);
+        }
+    }
+
+    return memory;
+}
+
+u8* BlockArena::AllocateReleased(const u64 size, u16& firstGeneration) {
+    std::lock_guard lock(Mutex);
+    auto it = ReleasedMemoryBySize.find(size);
+    if (it == ReleasedMemoryBySize.end() || it->second.empty()) {
+        return nullptr;
+    }
+
+    const ReleasedMemory released = it->second.back();
+    if (!CommitVirtualMemory(released.Memory, size)) {
+        return nullptr;
+    }
+    it->second.pop_back();
+    firstGeneration = released.FirstGeneration;
+    CommittedSize += size;
+    return released.Memory;
+}
+
+void BlockArena::Release(u8* memory, const u64 size, const u16 firstGeneration) {
+    WaitForReaders();
+    DecommitVirtualMemory(memory, size);
+
+    std::lock_guard lock(Mutex);
+    CommittedSize -= size;
+    ReleasedMemoryBySize[size].push_back({ memory, firstGeneration });
+}
+
+void BlockArena::SetBlockStart(const void* address, const bool isBlockStart) {
+    const u64 unit = ((const u8*) address - Base) / UnitSize;
+    const u64 bit = u64(1) << (unit % 64);
+    if (isBlockStart) {
+        BlockStarts[unit / 64].fetch_or(bit, std::memory_order_release);
+    } else {
+        // Ordered against ReadScope, a scope either sees the bit cleared or is waited for
+        BlockStarts[unit / 64].fetch_and(~bit, std::memory_order_seq_cst);
+    }
+}
+
+bool BlockArena::IsBlockStart(const void* address) const {
+    if (!Contains(address)) {
+        return false;
+    }
+
+    const u64 offset = (const u8*) address - Base;
+    if (offset % UnitSize != 0) {
+        return false;
+    }
+
+    const u64 unit = offset / UnitSize;
+    return (BlockStarts[unit / 64].load(std::memory_order_seq_cst) & (u64(1) << (unit % 64))) != 0;
+}
+
+void BlockArena::WaitForReaders() {
+    std::lock_guard lock(ReadersMutex);
+    for (u32 i = 0; i < 2; i++) {
+        const u32 parity = ReaderParity.fetch_xor(1, std::memory_order_seq_cst);
+        while (ReaderCounts[parity].load(std::memory_order_seq_cst) != 0) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+BlockArena::ReadScope::ReadScope() {
+    BlockArena& arena = Get();
+    Parity = arena.ReaderParity.load(std::memory_order_relaxed);
+    arena.ReaderCounts[Parity].fetch_add(1, std::memory_order_seq_cst);
+}
+
+BlockArena::ReadScope::~ReadScope() {
+    Get().ReaderCounts[Parity].fetch_sub(1, std::memory_order_release);
+}
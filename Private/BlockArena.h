@@ -0,0 +1,85 @@
+#pragma once
+
+#include "Object/Types.h"
+
+#include <atomic>
+#include <mutex>
+
+// A single reserved range of virtual memory that all pool blocks are carved out of.
+// Memory is only committed as pools grow, and because the range is fixed, whether an
+// address belongs to the object heap is a simple bounds check
+struct BlockArena {
+    static constexpr u64 UnitSize = 64 * 1024;
+    static constexpr u64 MaxReservationSize = sizeof(void*) == 8 ? (u64(64) << 30) : (u64(1) << 30);
+    static constexpr u64 MinReservationSize = u64(256) << 20;
+
+    static BlockArena& Get();
+
+    // Returns committed memory aligned to UnitSize, or nullptr if the arena is exhausted
+    u8* Allocate(u64 size, bool useHugePages);
+    // Reuses memory given back through Release, or nullptr if there's none of that size.
+    // firstGeneration is what was passed to Release for the memory
+    u8* AllocateReleased(u64 size, u16& firstGeneration);
+    // Decommits the memory, keeping the address range for reuse. Handles to objects that
+    // lived in it stay around, so whatever reuses it starts its slot generations from
+    // firstGeneration, which must be past every generation handed out so far.
+    // The block start must already be cleared, this waits for any ReadScope that might
+    // still be reading the block before giving the memory up
+    void Release(u8* memory, u64 size, u16 firstGeneration);
+
+    // Held while reading a block found through IsBlockStart from something that doesn't
+    // keep the block alive, like a handle. Release waits for every scope that was open
+    // when the block stopped being a block start, so the memory stays valid until it ends
+    struct ReadScope {
+        ReadScope();
+        ~ReadScope();
+        ReadScope(const ReadScope&) = delete;
+        ReadScope& operator=(const ReadScope&) = delete;
+
+    private:
+        u32 Parity;
+    };
+
+    void SetBlockStart(const void* address, bool isBlockStart);
+    // Anything that might not point at a live block, like a handle to an object whose block
+    // has been released or a pointer from outside the heap, has to check this before reading
+    // the block
+    bool IsBlockStart(const void* address) const;
+    bool Contains(const void* address) const { return (const u8*) address >= Base && (const u8*) address < Base + UsedSize.load(std::memory_order_acquire); }
+
+    // Units are numbered from the start of the arena
+    u32 GetUnitIndex(const void* address) const { return (u32)(((const u8*) address - Base) / UnitSize); }
+    u32 GetUnitCount() const { return (u32)(ReservedSize / UnitSize); }
+    void* GetUnitAddress(const u32 unit) const { return Base + (u64) unit * UnitSize; }
+
+    u64 GetReservedSize() const { return ReservedSize; }
+    u64 GetCommittedSize() const { return CommittedSize.load(std::memory_order_relaxed); }
+
+private:
+    BlockArena();
+    template<typename T>
+    friend T& GetNeverDestroyed();
+
+    void WaitForReaders();
+
+    u8* Base = nullptr;
+    u64 ReservedSize = 0;
+    std::atomic<u64> CommittedSize = 0;
+    // Everything below this has been handed out at some point
+    std::atomic<u64> UsedSize = 0;
+    // One bit per unit, set if a block starts at that unit. Read without the lock
+    Array<std::atomic<u64>> BlockStarts;
+    // Guards allocation and the released memory
+    std::mutex Mutex;
+    // Open read scopes, counted by the parity they started in. Release flips the parity
+    // and waits for the old count to drain, twice so scopes that raced the first flip
+    // are waited for too
+    std::atomic<u32> ReaderParity = 0;
+    std::atomic<u32> ReaderCounts[2] = {};
+    std::mutex ReadersMutex;
+    struct ReleasedMemory {
+        u8* Memory;
+        u16 FirstGeneration;
+    };
+    Map<u64, Array<ReleasedMemory>> ReleasedMemoryBySize;
+};
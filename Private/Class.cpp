@@ -1,101 +1,365 @@
 #include "Object/Object.h"
+#include "GarbageCollection.h"
+#include "ObjectPool.h"
 
-#include <algorithm>
+#include <cctype>
 
 IMPL_OBJECT(Enum, Object);
 
-const String& Enum::ToString(const i32 value) const {
-    for (i32 index = 0; index < values.size(); ++index) {
-        if (values[index] == value) {
-            return enumerators[index];
+namespace {
+    char ToLowerAscii(const char c) {
+        return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+
+    std::string_view TrimSpaces(std::string_view string) {
+        while (!string.empty() && std::isspace(static_cast<unsigned char>(string.front()))) {
+            string.remove_prefix(1);
         }
+        while (!string.empty() && std::isspace(static_cast<unsigned char>(string.back()))) {
+            string.remove_suffix(1);
+        }
+        return string;
+    }
+}
+
+usize Detail::CaseInsensitiveHash::operator()(const std::string_view string) const {
+    // FNV-1a over the lowered characters
+    u64 hash = 14695981039346656037ull;
+    for (const char c : string) {
+        hash ^= static_cast<u8>(ToLowerAscii(c));
+        hash *= 1099511628211ull;
+    }
+    return static_cast<usize>(hash);
+}
+
+bool Detail::CaseInsensitiveEqual::operator()(const std::string_view a, const std::string_view b) const {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (usize index = 0; index < a.size(); ++index) {
+        if (ToLowerAscii(a[index]) != ToLowerAscii(b[index])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Enum::BuildLookups() {
+    indicesByValue.reserve(values.size());
+    valuesByName.reserve(enumerators.size());
+    for (u32 index = 0; index < values.size(); ++index) {
+        // Aliased values keep the first enumerator, as the linear search used to
+        indicesByValue.emplace(values[index], index);
+        valuesByName.emplace(enumerators[index], values[index]);
+    }
+}
+
+const String& Enum::ToString(const i32 value) const {
+    const auto it = indicesByValue.find(value);
+    if (it != indicesByValue.end()) {
+        return enumerators[it->second];
     }
 
     static String unknown = "UNKNOWN_ENUMERATOR_VALUE";
     return unknown;
 }
 
-i32 Enum::FromString(const String& value) const {
-    auto tolower = [](const String& v) {
-        String lowerValue = v;
-        std::transform(lowerValue.begin(), lowerValue.end(), lowerValue.begin(), [](char c) { return std::tolower(c); });
-        return lowerValue;
-    };
+i32 Enum::FromString(const std::string_view value) const {
+    const auto it = valuesByName.find(value);
+    return it != valuesByName.end() ? it->second : -1;
+}
 
-    const String lowerValue = tolower(value);
-    for (i32 index = 0; index < enumerators.size(); ++index) {
-        if (lowerValue == tolower(enumerators[index])) {
-            return values[index];
+String Enum::FlagsToString(const i32 value) const {
+    if (value == 0) {
+        const auto it = indicesByValue.find(0);
+        return it != indicesByValue.end() ? enumerators[it->second] : String();
+    }
+
+    String result;
+    i32 remaining = value;
+    for (u32 index = 0; index < values.size() && remaining != 0; ++index) {
+        const i32 enumeratorValue = values[index];
+        if (enumeratorValue != 0 && (remaining & enumeratorValue) == enumeratorValue) {
+            if (!result.empty()) {
+                result += '|';
+            }
+            result += enumerators[index];
+            remaining &= ~enumeratorValue;
         }
     }
 
-    return -1;
+    if (remaining != 0) [[unlikely]] {
+        return ToString(value);
+    }
+    return result;
+}
+
+i32 Enum::FlagsFromString(std::string_view value) const {
+    i32 result = 0;
+    while (true) {
+        const usize separator = value.find('|');
+        const std::string_view enumerator = TrimSpaces(value.substr(0, separator));
+        if (!enumerator.empty() || separator != std::string_view::npos) {
+            const auto it = valuesByName.find(enumerator);
+            if (it == valuesByName.end()) {
+                return -1;
+            }
+            result |= it->second;
+        }
+        if (separator == std::string_view::npos) {
+            return result;
+        }
+        value.remove_prefix(separator + 1);
+    }
+}
+
+Map<InternedString, Class*>& GetClassesByName() {
+    static Map<InternedString, Class*> classesByName;
+    return classesByName;
+}
+
+// Guards the class hierarchy and the name index, classes registered on demand may be
+// registered from any thread
+std::mutex& GetClassRegistryMutex() {
+    static std::mutex mutex;
+    return mutex;
 }
 
-Array<Class*>& GetAllClasses() {
-    static Array<Class*> allClasses;
-    return allClasses;
+Class* Class::FindClass(const std::string_view name) {
+    const InternedString internedName = InternedString::Find(name);
+    if (internedName.IsEmpty()) {
+        return nullptr;
+    }
+
+    std::lock_guard lock(GetClassRegistryMutex());
+    const Map<InternedString, Class*>& classesByName = GetClassesByName();
+    const auto it = classesByName.find(internedName);
+    return it != classesByName.end() ? it->second : nullptr;
 }
 
 Array<Class*> Class::GetDerivedClasses() const {
-    Array<Class*> derivedClasses;
-    for (Class* maybeDerivedClass : GetAllClasses()) {
-        if (maybeDerivedClass != this && maybeDerivedClass->IsDerivedFrom(this)) {
-            derivedClasses.emplace_back(maybeDerivedClass);
+    std::lock_guard lock(GetClassRegistryMutex());
+    return derivedClasses;
+}
+
+Array<Class*> Class::GetChildClasses() const {
+    std::lock_guard lock(GetClassRegistryMutex());
+    return childClasses;
+}
+
+static const Array<ObjectField*>& GetNoFields() {
+    static Array<ObjectField*> noFields;
+    return noFields;
+}
+
+const Array<ObjectField*>& Class::GetFieldsWithTag(const InternedString tag) const {
+    EnsureFieldsRegistered();
+    const auto it = fieldsByTag.find(tag);
+    if (it != fieldsByTag.end()) {
+        return it->second;
+    }
+    return GetNoFields();
+}
+
+const Array<ObjectField*>& Class::GetFieldsWithTag(const std::string_view tag) const {
+    // Names that have never been interned can't be tags
+    const InternedString internedTag = InternedString::Find(tag);
+    return !internedTag.IsEmpty() ? GetFieldsWithTag(internedTag) : GetNoFields();
+}
+
+void Class::Construct(Object* object) {
+    constructor(object);
+}
+
+void Class::Register() {
+    pool = ObjectPool::GetPoolForObjectSize(size);
+
+    // Parents are always registered first, StaticClass<Parent> is called while configuring
+    if (parent) {
+        ancestors = parent->ancestors;
+        depth = parent->depth + 1;
+    }
+    ancestors.emplace_back(this);
+
+    std::lock_guard lock(GetClassRegistryMutex());
+    if (parent) {
+        parent->childClasses.emplace_back(this);
+    }
+    for (u32 ancestorDepth = 0; ancestorDepth < depth; ++ancestorDepth) {
+        ancestors[ancestorDepth]->derivedClasses.emplace_back(this);
+    }
+    GetClassesByName().emplace(name, this);
+}
+
+void Class::RegisterFields() {
+    std::call_once(fieldsRegisteredFlag, [this] {
+        describeFields(this);
+
+        fieldTable.reserve(fields.size());
+        for (const UniquePtr<ObjectField>& field : fields) {
+            ClassField& entry = fieldTable.emplace_back();
+            entry.Name = field->Name;
+            entry.Offset = field->Offset;
+            entry.Type = field->Type;
+            entry.TagCount = (u16) field->GetTags().size();
+            entry.Tags = field->GetTags().data();
+            for (const auto& [tag, value] : field->GetTags()) {
+                fieldsByTag[tag].emplace_back(field.get());
+            }
+
+            const ObjectField* element = field.get();
+            if (field->Type == ObjectFieldType::Array) {
+                element = static_cast<const ArrayObjectField&>(*field).InnerType.get();
+            }
+            entry.ElementType = element->Type;
+            entry.ObjectClass = element->Type == ObjectFieldType::Object ? static_cast<const ObjectObjectField*>(element)->InnerType : nullptr;
+            entry.EnumType = element->Type == ObjectFieldType::Enum ? static_cast<const EnumObjectField*>(element)->EnumClass : nullptr;
         }
+
+        for (const ClassField& field : fieldTable) {
+            if (field.Type == ObjectFieldType::Object) {
+                objectReferenceOffsets.push_back(field.Offset);
+            } else if (field.Type == ObjectFieldType::Array && field.ElementType == ObjectFieldType::Object) {
+                objectArrayReferenceOffsets.push_back(field.Offset);
+            }
+        }
+
+        areFieldsRegistered.store(true, std::memory_order_release);
+    });
+}
+
+void Class::AddInstance(Object* object) {
+    const ObjectMetadata metadata = GetMetadataForPoolObject(object);
+    std::atomic_ref<Object*> link(metadata.Block->InstanceLinks[metadata.Slot]);
+    Object* head = newInstances.load(std::memory_order_relaxed);
+    do {
+        link.store(head, std::memory_order_relaxed);
+    } while (!newInstances.compare_exchange_weak(head, object, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void Class::TakeNewInstances() {
+    // Only whole lists are taken, so a list can't change under us once it's ours
+    const usize firstNewInstance = instances.size();
+    Object* object = newInstances.exchange(this, std::memory_order_acquire);
+    while (object != this) {
+        const ObjectMetadata metadata = GetMetadataForPoolObject(object);
+        std::atomic_ref<Object*> link(metadata.Block->InstanceLinks[metadata.Slot]);
+        Object* next = link.load(std::memory_order_relaxed);
+        instances.emplace_back(GetHandleForMetadata(metadata));
+        // The slot can be reclaimed as soon as this is seen, see ObjectPool::TakeOffNewInstances
+        link.store(nullptr, std::memory_order_release);
+        object = next;
+    }
+    // The newest object was at the front
+    std::reverse(instances.begin() + firstNewInstance, instances.end());
+
+    constexpr usize minInstancesToCompact = 64;
+    if (iteratingRangeCount == 0 && instances.size() >= std::max(2 * compactedInstanceCount, minInstancesToCompact)) {
+        BlockArena::ReadScope readScope;
+        std::erase_if(instances, [](const ObjectHandle handle) { return !GetMetadataForHandle(handle); });
+        compactedInstanceCount = instances.size();
     }
-    return derivedClasses;
 }
 
-bool Class::IsDerivedFrom(const Class* parentClass) const {
-    if (!IsValid(parentClass)) {
-        return false;
+ObjectRangeBase::ObjectRangeBase(Class* objectClass, const bool includeDerived) {
+    classes.emplace_back(objectClass);
+    if (includeDerived) {
+        for (Class* derivedClass : objectClass->GetDerivedClasses()) {
+            classes.emplace_back(derivedClass);
+        }
     }
+    EnterClass(classes[0]);
+    Next();
+}
+
+ObjectRangeBase::~ObjectRangeBase() {
+    LeaveClass();
+}
+
+void ObjectRangeBase::Next() {
+    current = nullptr;
+    while (visitingClass) {
+        while (batchIndex < batchCount || NextBatch()) {
+            Object* object = ResolveObjectHandle(batch[batchIndex++]);
+            if (object) {
+                // Like a weak pointer, it may only have been reachable through the range
+                ShadeWeakReference(object);
+                current = object;
+                return;
+            }
+        }
 
-    if (this == parentClass) {
-        return true;
+        LeaveClass();
+        if (++classIndex < classes.size()) {
+            EnterClass(classes[classIndex]);
+        }
     }
+}
 
-    if (!IsValid(Parent())) {
+bool ObjectRangeBase::NextBatch() {
+    if (instanceIndex == instanceCount) {
         return false;
     }
 
-    return Parent()->IsDerivedFrom(parentClass);
+    std::lock_guard lock(visitingClass->instancesMutex);
+    batchIndex = 0;
+    batchCount = std::min(instanceCount - instanceIndex, BatchSize);
+    std::copy_n(visitingClass->instances.begin() + instanceIndex, batchCount, batch.begin());
+    instanceIndex += batchCount;
+    return true;
 }
 
-void Class::Construct(Object* object) {
-    constructor(object);
+void ObjectRangeBase::EnterClass(Class* nextClass) {
+    std::lock_guard lock(nextClass->instancesMutex);
+    nextClass->TakeNewInstances();
+    nextClass->iteratingRangeCount++;
+    visitingClass = nextClass;
+    instanceIndex = 0;
+    batchIndex = 0;
+    batchCount = 0;
+    // Objects added after this point go on the end, so they're never reached
+    instanceCount = (u32) nextClass->instances.size();
 }
 
-void Class::Register() {
-    GetAllClasses().emplace_back(this);
+void ObjectRangeBase::LeaveClass() {
+    if (!visitingClass) {
+        return;
+    }
+
+    std::lock_guard lock(visitingClass->instancesMutex);
+    visitingClass->iteratingRangeCount--;
+    visitingClass = nullptr;
 }
 
 template<>
 void Detail::ConfigureClass<Object>(Class* classInstance) {
     classInstance->parent = nullptr;
-    classInstance->name = "Object";
+    classInstance->name = InternedString("Object");
     classInstance->size = sizeof(Object);
     classInstance->constructor = [](Object* object) {
         new (object) Object{};
     };
-    StaticInstance<Object>()->GetObjectFields(classInstance->fields);
-    StaticInstance<Object>()->classInstance = classInstance;
-    classInstance->staticInstance = StaticInstance<Object>();
+    classInstance->describeFields = [](Class* classInstance) {
+        StaticInstance<Object>()->GetObjectFields(classInstance->fields);
+        StaticInstance<Object>()->classInstance = classInstance;
+        classInstance->staticInstance = StaticInstance<Object>();
+    };
     classInstance->Register();
 }
 
 template<>
 void Detail::ConfigureClass<Class>(Class* classInstance) {
     classInstance->parent = StaticClass<Object>();
-    classInstance->name = "Class";
+    classInstance->name = InternedString("Class");
     classInstance->size = sizeof(Class);
     classInstance->constructor = [](Object* object) {
         new (object) Class{};
     };
-    StaticInstance<Class>()->GetObjectFields(classInstance->fields);
-    StaticInstance<Class>()->classInstance = classInstance;
-    classInstance->staticInstance = StaticInstance<Class>();
+    classInstance->describeFields = [](Class* classInstance) {
+        StaticInstance<Class>()->GetObjectFields(classInstance->fields);
+        StaticInstance<Class>()->classInstance = classInstance;
+        classInstance->staticInstance = StaticInstance<Class>();
+    };
     classInstance->Register();
 }
 
@@ -0,0 +1,65 @@
+#include "CollectionWorkers.h"
+#include "Object/ObjectHeap.h"
+#include "ObjectStatics.h"
+
+#include <algorithm>
+
+CollectionWorkers& CollectionWorkers::Get() {
+    return GetNeverDestroyed<CollectionWorkers>();
+}
+
+u32 CollectionWorkers::GetThreadCount() {
+    const u32 threadCount = GetObjectHeapSettings().CollectionThreadCount;
+    if (threadCount != 0) {
+        return threadCount;
+    }
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+void CollectionWorkers::Run(const u32 workerCount, const std::function<void(u32 workerIndex)>& task) {
+    if (workerCount <= 1) {
+        task(0);
+        return;
+    }
+
+    {
+        std::lock_guard lock(Mutex);
+        while (Threads.size() < workerCount - 1) {
+            const u32 workerIndex = Threads.size() + 1;
+            Threads.emplace_back([this, workerIndex] { WorkerLoop(workerIndex); });
+        }
+
+        Task = &task;
+        RunWorkerCount = workerCount;
+        RunningWorkerCount = workerCount - 1;
+        RunIndex++;
+    }
+    WorkAvailable.notify_all();
+
+    task(0);
+
+    std::unique_lock lock(Mutex);
+    WorkFinished.wait(lock, [this] { return RunningWorkerCount == 0; });
+    Task = nullptr;
+}
+
+void CollectionWorkers::WorkerLoop(const u32 workerIndex) {
+    u64 lastRunIndex = 0;
+    std::unique_lock lock(Mutex);
+    while (true) {
+        WorkAvailable.wait(lock, [this, lastRunIndex] { return RunIndex != lastRunIndex; });
+        lastRunIndex = RunIndex;
+        if (workerIndex >= RunWorkerCount) {
+            continue;
+        }
+
+        const std::function<void(u32)>& task = *Task;
+        lock.unlock();
+        task(workerIndex);
+        lock.lock();
+
+        if (--RunningWorkerCount == 0) {
+            WorkFinished.notify_one();
+        }
+    }
+}
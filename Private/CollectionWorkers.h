@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Object/Types.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Threads kept around between collections so parallel phases don't pay for creating
+// them every time. The thread that starts a phase takes part in it as worker 0
+struct CollectionWorkers {
+    static CollectionWorkers& Get();
+
+    static u32 GetThreadCount();
+
+    // Runs the task on workerCount threads and returns once all of them have finished
+    void Run(u32 workerCount, const std::function<void(u32 workerIndex)>& task);
+
+private:
+    CollectionWorkers() = default;
+    template<typename T>
+    friend T& GetNeverDestroyed();
+
+    void WorkerLoop(u32 workerIndex);
+
+    std::mutex Mutex;
+    std::condition_variable WorkAvailable;
+    std::condition_variable WorkFinished;
+    Array<std::thread> Threads;
+
+    const std::function<void(u32)>* Task = nullptr;
+    u64 RunIndex = 0;
+    u32 RunWorkerCount = 0;
+    u32 RunningWorkerCount = 0;
+};
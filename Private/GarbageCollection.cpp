@@ -1,131 +1,915 @@
 #include "Object/Object.h"
+#include "Object/ObjectHeap.h"
+#include "CollectionWorkers.h"
 #include "ObjectPool.h"
 
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <thread>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Roots are kept densely packed for marking, removal swaps the last root into the gap
 Array<Object*>& GetRootSet() {
     static Array<Object*> rootSet;
     return rootSet;
 }
 
-void MarkObjectsReachableFrom(Object* object) {
-    const Array<UniquePtr<ObjectField>>& fields = object->GetObjectFields();
-    for (const UniquePtr<ObjectField>& field : fields) {
-        if (field->Type == ObjectFieldType::Object) {
-            ObjectObjectField& objectField = static_cast<ObjectObjectField&>(*field);
-            Object** referencedObject = objectField.GetValuePtr(object);
-            if (!*referencedObject) {
+// Where each root is in the root set
+Map<Object*, u32>& GetRootSetIndices() {
+    static Map<Object*, u32> rootSetIndices;
+    return rootSetIndices;
+}
+
+// Guards the root set and its indices. Roots can be added from any thread, e.g. when a class
+// registered on demand first roots its static objects, so the collector works from copies
+// unless it only needs the roots briefly
+std::mutex& GetRootSetMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+Array<Object*> GetRootSetSnapshot() {
+    std::lock_guard lock(GetRootSetMutex());
+    return GetRootSet();
+}
+
+inline void Prefetch(const void* address) {
+#if defined(_MSC_VER)
+    _mm_prefetch((const char*) address, _MM_HINT_T0);
+#else
+    __builtin_prefetch(address);
+#endif
+}
+
+// Objects that have been marked but not yet scanned. Popped objects sit in a small
+// FIFO after being prefetched, so their memory is hopefully in cache by the time
+// their fields are scanned
+struct MarkStack {
+    static constexpr u32 PrefetchDistance = 8;
+
+    Array<Object*> Objects;
+    std::array<Object*, PrefetchDistance> PrefetchQueue{};
+    u32 PrefetchQueueStart = 0;
+    u32 PrefetchQueueCount = 0;
+
+    void Push(Object* object) {
+        Objects.push_back(object);
+    }
+
+    Object* Pop() {
+        // Keep the queue topped up while there's work on the stack
+        while (PrefetchQueueCount < PrefetchDistance && !Objects.empty()) {
+            Object* object = Objects.back();
+            Objects.pop_back();
+            Prefetch(object);
+            PrefetchQueue[(PrefetchQueueStart + PrefetchQueueCount++) % PrefetchDistance] = object;
+        }
+
+        if (PrefetchQueueCount == 0) {
+            return nullptr;
+        }
+        Object* object = PrefetchQueue[PrefetchQueueStart];
+        PrefetchQueueStart = (PrefetchQueueStart + 1) % PrefetchDistance;
+        PrefetchQueueCount--;
+        return object;
+    }
+};
+
+// Returns whether the reference is to a destroyed or destroying object. Those references
+// are removed, unless the object may be being read on another thread
+template<bool ClearDestroyedReferences>
+bool MarkReference(Object*& referencedObject, MarkStack& markStack) {
+    if (!referencedObject) {
+        return false;
+    }
+
+    const ObjectMetadata metadata = GetMetadataForObject(referencedObject);
+    if (!metadata) {
+        // TODO: this is bad, we should really warn about it
+        return false;
+    }
+
+    if (metadata.Mark()) {
+        markStack.Push(referencedObject);
+    }
+
+    if (!HasAnyFlags(metadata.Flags(), ObjectFlags::IsBeingDestroyed | ObjectFlags::IsDestroyed)) {
+        return false;
+    }
+    if constexpr (ClearDestroyedReferences) {
+        referencedObject = nullptr;
+    }
+    return true;
+}
+
+// Returns whether the object references any destroyed or destroying objects, see MarkReference
+template<bool ClearDestroyedReferences = true>
+bool ScanObjectFields(Object* object, MarkStack& markStack) {
+    const Class* objectClass = object->GetClass();
+    if (!objectClass || !objectClass->HasObjectReferences()) {
+        return false;
+    }
+
+    bool hasDestroyedReferences = false;
+    u8* base = (u8*) object;
+    for (const u32 offset : objectClass->ObjectReferenceOffsets()) {
+        hasDestroyedReferences |= MarkReference<ClearDestroyedReferences>(*(Object**)(base + offset), markStack);
+    }
+    for (const u32 offset : objectClass->ObjectArrayReferenceOffsets()) {
+        Array<Object*>& objects = *(Array<Object*>*)(base + offset);
+        Prefetch(objects.data());
+        for (Object*& referencedObject : objects) {
+            hasDestroyedReferences |= MarkReference<ClearDestroyedReferences>(referencedObject, markStack);
+        }
+    }
+    return hasDestroyedReferences;
+}
+
+// Each marker works from its own stack, and when it has plenty of work it moves some
+// of it to a shared stack that idle markers can steal from
+struct MarkWorker {
+    static constexpr u32 ShareBatchSize = 64;
+
+    MarkStack Stack;
+    std::mutex SharedMutex;
+    Array<Object*> Shared;
+};
+
+struct ParallelMark {
+    Array<UniquePtr<MarkWorker>> Workers;
+    u32 WorkerCount = 0;
+    std::atomic<u32> ActiveWorkerCount = 0;
+    // Number of objects waiting in the shared stacks
+    std::atomic<i64> SharedObjectCount = 0;
+
+    void ShareWork(MarkWorker& worker) {
+        std::lock_guard lock(worker.SharedMutex);
+        if (!worker.Shared.empty()) {
+            return;
+        }
+
+        // Share from the bottom of the stack, objects there are likely to lead to the most work
+        Array<Object*>& objects = worker.Stack.Objects;
+        worker.Shared.assign(objects.begin(), objects.begin() + MarkWorker::ShareBatchSize);
+        objects.erase(objects.begin(), objects.begin() + MarkWorker::ShareBatchSize);
+        SharedObjectCount.fetch_add(MarkWorker::ShareBatchSize);
+    }
+
+    bool StealWork(const u32 workerIndex) {
+        MarkWorker& thief = *Workers[workerIndex];
+        for (u32 offset = 0; offset < WorkerCount; ++offset) {
+            MarkWorker& victim = *Workers[(workerIndex + offset) % WorkerCount];
+            std::lock_guard lock(victim.SharedMutex);
+            if (victim.Shared.empty()) {
                 continue;
             }
 
-            ObjectHeader* referencedObjectHeader = GetHeaderForObject(*referencedObject);
-            if (!referencedObjectHeader || referencedObjectHeader->Magic != ObjectHeader::RequiredMagic) {
-                // TODO: this is bad, we should really warn about it
-                continue;
+            // Take back everything we shared ourselves, or half of someone else's
+            const usize count = &victim == &thief ? victim.Shared.size() : (victim.Shared.size() + 1) / 2;
+            thief.Stack.Objects.insert(thief.Stack.Objects.end(), victim.Shared.end() - count, victim.Shared.end());
+            victim.Shared.erase(victim.Shared.end() - count, victim.Shared.end());
+            SharedObjectCount.fetch_sub(count);
+            return true;
+        }
+        return false;
+    }
+
+    void Drain(const u32 workerIndex) {
+        MarkWorker& worker = *Workers[workerIndex];
+        while (Object* object = worker.Stack.Pop()) {
+            ScanObjectFields(object, worker.Stack);
+            if (WorkerCount > 1 && worker.Stack.Objects.size() >= 2 * MarkWorker::ShareBatchSize) {
+                ShareWork(worker);
             }
+        }
+    }
 
-            if (HasAnyFlags(referencedObjectHeader->Flags, ObjectFlags::Unreachable)) {
-                UnsetFlag(referencedObjectHeader->Flags, ObjectFlags::Unreachable);
-                MarkObjectsReachableFrom(*referencedObject);
+    void Run(const u32 workerIndex) {
+        while (true) {
+            Drain(workerIndex);
+            if (StealWork(workerIndex)) {
+                continue;
             }
 
-            // Remove pointers to destroyed / destroying objects
-            if (HasAnyFlags(referencedObjectHeader->Flags, ObjectFlags::IsBeingDestroyed | ObjectFlags::IsDestroyed)) {
-                *referencedObject = nullptr;
+            // Out of work. Shared work is always published before its worker goes idle,
+            // so once every worker is idle and nothing is shared, marking is finished
+            ActiveWorkerCount.fetch_sub(1);
+            while (true) {
+                if (SharedObjectCount.load() > 0) {
+                    ActiveWorkerCount.fetch_add(1);
+                    if (StealWork(workerIndex)) {
+                        break;
+                    }
+                    ActiveWorkerCount.fetch_sub(1);
+                } else if (ActiveWorkerCount.load() == 0) {
+                    if (SharedObjectCount.load() == 0) {
+                        return;
+                    }
+                } else {
+                    std::this_thread::yield();
+                }
             }
-        } else if (field->Type == ObjectFieldType::Array) {
-            ArrayObjectField& arrayField = static_cast<ArrayObjectField&>(*field);
-            if (arrayField.InnerType->Type != ObjectFieldType::Object) {
+        }
+    }
+};
+
+ParallelMark& GetParallelMark() {
+    static ParallelMark parallelMark;
+    return parallelMark;
+}
+
+void MarkFromRootSet(const u32 workerCount) {
+    const Array<Object*> roots = GetRootSetSnapshot();
+
+    ParallelMark& mark = GetParallelMark();
+    while (mark.Workers.size() < workerCount) {
+        mark.Workers.emplace_back(MakeUnique<MarkWorker>());
+    }
+    mark.WorkerCount = workerCount;
+    mark.ActiveWorkerCount = workerCount;
+    mark.SharedObjectCount = 0;
+
+    CollectionWorkers::Get().Run(workerCount, [&mark, &roots, workerCount](const u32 workerIndex) {
+        // Each worker starts from its own share of the root set
+        MarkWorker& worker = *mark.Workers[workerIndex];
+        const usize firstRoot = roots.size() * workerIndex / workerCount;
+        const usize lastRoot = roots.size() * (workerIndex + 1) / workerCount;
+        for (usize index = firstRoot; index < lastRoot; ++index) {
+            Object* object = roots[index];
+            const ObjectMetadata metadata = GetMetadataForObject(object);
+            if (!metadata) {
+                // TODO: This is bad, we should really warn about it
                 continue;
             }
 
-            Array<Object*>* objects = (Array<Object*>*) arrayField.GetUntypedValuePtr(object);
-            for (Object*& referencedObject : *objects) {
-                if (!referencedObject) {
-                    continue;
-                }
-                ObjectHeader* referencedObjectHeader = GetHeaderForObject(referencedObject);
-                if (!referencedObjectHeader || referencedObjectHeader->Magic != ObjectHeader::RequiredMagic) {
-                    // TODO: this is bad, we should really warn about it
-                    continue;
-                }
+            if (metadata.Mark()) {
+                worker.Stack.Push(object);
+            }
+        }
+        mark.Run(workerIndex);
+    });
+}
 
-                if (HasAnyFlags(referencedObjectHeader->Flags, ObjectFlags::Unreachable)) {
-                    UnsetFlag(referencedObjectHeader->Flags, ObjectFlags::Unreachable);
-                    MarkObjectsReachableFrom(referencedObject);
-                }
+// Unmarks every object by starting a new mark epoch, and returns the number of blocks in the heap
+usize ClearMarks() {
+    ObjectBlock::AdvanceMarkEpoch();
+    usize blockCount = 0;
+    for (const UniquePtr<ObjectPool>& pool : ObjectPool::GetPools()) {
+        blockCount += pool->GetBlocks().size();
+    }
+    return blockCount;
+}
 
-                // Remove pointers to destroyed / destroying objects
-                if (HasAnyFlags(referencedObjectHeader->Flags, ObjectFlags::IsBeingDestroyed | ObjectFlags::IsDestroyed)) {
-                    referencedObject = nullptr;
-                }
+// Pinned objects are in use on other threads, so they're kept along with everything they
+// reference. Every other unreachable object is set dying as it's passed, so it can't be pinned
+// afterwards. Ones found through a pinned object may have been passed already, so they're made
+// pinnable again as they're scanned
+void KeepPinnedObjectsInBlock(ObjectBlock* block, MarkStack& markStack) {
+    if (!block->HasUnmarkedObjects()) {
+        return;
+    }
+
+    for (u32 word = 0; word < block->BitmapWordCount; ++word) {
+        u64 unreachable = block->AllocatedBits[word] & ~block->GetMarkWord(word);
+        while (unreachable) {
+            const u32 slot = word * 64 + std::countr_zero(unreachable);
+            unreachable &= unreachable - 1;
+
+            const ObjectFlags flags = block->Flags[slot];
+            if (!HasAnyFlags(flags, ObjectFlags::Allocated) || HasAnyFlags(flags, ObjectFlags::IsBeingDestroyed | ObjectFlags::IsDestroyed)) {
+                continue;
             }
+            if (!block->TrySetDying(slot) && block->Mark(slot)) {
+                markStack.Push(block->GetObject(slot));
+            }
+        }
+    }
+
+    while (Object* object = markStack.Pop()) {
+        const ObjectMetadata metadata = GetMetadataForPoolObject(object);
+        if (!HasAnyFlags(metadata.Flags(), ObjectFlags::IsBeingDestroyed | ObjectFlags::IsDestroyed)) {
+            metadata.Block->ClearDying(metadata.Slot);
         }
+        ScanObjectFields(object, markStack);
     }
 }
 
-void FreeUnreachableObjectsInPool(ObjectPool& pool) {
-    u64 stride = pool.PoolElementSize + sizeof(ObjectHeader);
-    for (Array<u8>& block : pool.GetBlocks()) {
-        const u8* end = block.data() + block.size();
-        for (u8* headerAddress = block.data(); headerAddress < end; headerAddress += stride) {
-            ObjectHeader* header = (ObjectHeader*) headerAddress;
-            if (header->Magic != ObjectHeader::RequiredMagic) {
-                // TODO: This is bad, we should really warn about it
+// Returns whether any of the block's unreachable objects have finished being destroyed
+bool DestroyUnreachableObjectsInBlock(ObjectBlock* block) {
+    if (!block->HasUnmarkedObjects()) {
+        return false;
+    }
+
+    // Only allocated, unmarked slots are visited, a word at a time
+    bool hasDestroyedObjects = false;
+    for (u32 word = 0; word < block->BitmapWordCount; ++word) {
+        u64 unreachable = block->AllocatedBits[word] & ~block->GetMarkWord(word);
+        while (unreachable) {
+            const u32 slot = word * 64 + std::countr_zero(unreachable);
+            unreachable &= unreachable - 1;
+
+            ObjectFlags& flags = block->Flags[slot];
+            if (!HasAnyFlags(flags, ObjectFlags::Allocated)) {
                 continue;
             }
 
-            if (!HasAnyFlags(header->Flags, ObjectFlags::Allocated)) {
+            // Pinned objects have been marked by KeepPinnedObjectsInBlock, so none of these are in use
+            Object* object = block->GetObject(slot);
+            if (!HasAnyFlags(flags, ObjectFlags::IsBeingDestroyed | ObjectFlags::IsDestroyed)) {
+                object->Destroy();
+            }
+            if (!HasAnyFlags(flags, ObjectFlags::IsDestroyed)) {
+                object->TryCompleteDestruction();
+            }
+            hasDestroyedObjects |= HasAnyFlags(flags, ObjectFlags::IsDestroyed);
+        }
+    }
+    return hasDestroyedObjects;
+}
+
+// Destroys the pool's unreachable objects, and adds the blocks holding any which have
+// finished being destroyed to the blocks to sweep
+void DestroyUnreachableObjectsInPool(ObjectPool& pool, Array<ObjectBlock*>& blocksToSweep) {
+    Array<ObjectBlock*>& blocks = pool.GetBlocks();
+    for (usize blockIndex = 0; blockIndex < blocks.size(); ++blockIndex) {
+        ObjectBlock* block = blocks[blockIndex];
+        if (DestroyUnreachableObjectsInBlock(block)) {
+            blocksToSweep.emplace_back(block);
+        }
+    }
+}
+
+void SweepBlocks(const Array<ObjectBlock*>& blocks) {
+    if (GetObjectHeapSettings().SweepMode == ObjectSweepMode::Lazy) {
+        for (ObjectBlock* block : blocks) {
+            block->Pool->DeferSweep(block);
+        }
+        return;
+    }
+
+    std::atomic<usize> nextBlockIndex = 0;
+    const u32 workerCount = std::clamp<usize>(blocks.size(), 1, CollectionWorkers::GetThreadCount());
+    CollectionWorkers::Get().Run(workerCount, [&blocks, &nextBlockIndex](u32) {
+        for (usize index = nextBlockIndex++; index < blocks.size(); index = nextBlockIndex++) {
+            blocks[index]->Pool->SweepBlock(blocks[index]);
+        }
+    });
+}
+
+void FinishDeferredSweeps() {
+    // Blocks left for the allocator by the last collection still rely on its marks
+    for (const UniquePtr<ObjectPool>& pool : ObjectPool::GetPools()) {
+        pool->FinishDeferredSweeps();
+    }
+}
+
+void ReleaseEmptyBlocks() {
+    Array<UniquePtr<ObjectPool>>& pools = ObjectPool::GetPools();
+    for (usize index = 0; index < pools.size(); ++index) {
+        pools[index]->ReleaseEmptyBlocks();
+    }
+}
+
+enum class IncrementalCollectionPhase : u8 {
+    Idle,
+    FinishingSweeps,
+    ShadingRoots,
+    Marking,
+    KeepingPinnedObjects,
+    Destroying,
+    Sweeping,
+    ReleasingBlocks,
+};
+
+// Progress of the incremental collection, which is picked up again by the next slice
+struct IncrementalCollection {
+    IncrementalCollectionPhase Phase = IncrementalCollectionPhase::Idle;
+    // Read by the write barrier, which may be called from any thread. Only changed with
+    // ShadedObjectsMutex held, so nothing can be shaded after the last shaded objects are taken
+    std::atomic<bool> IsMarking = false;
+    // From the end of marking until every unmarked object has started being destroyed. Objects
+    // found through handles in that time may be unmarked, and must not be handed out
+    std::atomic<bool> IsDestroyingUnmarkedObjects = false;
+    MarkStack Stack;
+    // Objects shaded by the write barrier, which may be called from any thread
+    std::mutex ShadedObjectsMutex;
+    Array<Object*> ShadedObjects;
+    // Counts down, so roots removed between slices only move ones already shaded
+    usize RootIndex = 0;
+    usize PoolIndex = 0;
+    usize BlockIndex = 0;
+    Array<ObjectBlock*> BlocksToSweep;
+    usize SweepIndex = 0;
+    EmptyBlockRelease BlockRelease;
+};
+
+IncrementalCollection& GetIncrementalCollection() {
+    static IncrementalCollection collection;
+    return collection;
+}
+
+// Young objects are the ones allocated since the last collection, and are the only ones
+// left unmarked after it. A minor collection keeps the marks, so it only traces and
+// sweeps young objects, and the ones it finds become old by being marked
+struct GenerationalCollection {
+    // Set by the first minor collection. From then on the write barrier stays enabled
+    std::atomic<bool> IsActive = false;
+    // Old objects which have had references to young objects written to them
+    std::mutex RememberedSetMutex;
+    Array<Object*> RememberedSet;
+};
+
+GenerationalCollection& GetGenerationalCollection() {
+    static GenerationalCollection collection;
+    return collection;
+}
+
+// Marking on a background thread while the game keeps running. Before an object is first
+// changed the write barrier scans it, so every reference it held when marking started is
+// seen, and the marker never reads an object while it's being changed
+struct ConcurrentCollection {
+    // Read by the write barrier, which may be called from any thread
+    std::atomic<bool> IsMarking = false;
+    std::atomic<bool> IsMarkerFinished = false;
+    std::thread Marker;
+    // Held while scanning objects and using the stack, by the marker and the write barrier
+    std::mutex ScanMutex;
+    MarkStack Stack;
+    // Scanned objects referencing destroyed objects. The game may be reading them while
+    // marking, so the references are only removed once it's paused for the finish
+    Array<Object*> ObjectsWithDestroyedReferences;
+};
+
+ConcurrentCollection& GetConcurrentCollection() {
+    static ConcurrentCollection collection;
+    return collection;
+}
+
+void FinishConcurrentCollection();
+
+std::atomic<bool> Detail::WriteBarrierEnabled = false;
+
+void UpdateWriteBarrierEnabled() {
+    Detail::WriteBarrierEnabled = GetIncrementalCollection().IsMarking || GetConcurrentCollection().IsMarking || GetGenerationalCollection().IsActive;
+}
+
+// Must be called with the scan mutex held. The scanned bit is only set once the scan is
+// done, so the barrier can check it without the lock
+void ScanObjectOnce(Object* object, ConcurrentCollection& collection) {
+    const ObjectMetadata metadata = GetMetadataForObject(object);
+    if (metadata && !metadata.IsScanned()) {
+        if (ScanObjectFields<false>(object, collection.Stack)) {
+            collection.ObjectsWithDestroyedReferences.push_back(object);
+        }
+        metadata.SetScanned();
+    }
+}
+
+void ScanBeforeWrite(Object* object) {
+    const ObjectMetadata metadata = GetMetadataForObject(object);
+    if (!metadata || metadata.IsScanned()) {
+        return;
+    }
+
+    ConcurrentCollection& collection = GetConcurrentCollection();
+    std::lock_guard lock(collection.ScanMutex);
+    ScanObjectOnce(object, collection);
+}
+
+void RunConcurrentMarker(ConcurrentCollection& collection) {
+    // Let the barrier in every so often
+    constexpr u32 objectsPerLock = 256;
+
+    while (true) {
+        std::lock_guard lock(collection.ScanMutex);
+        for (u32 index = 0; index < objectsPerLock; ++index) {
+            Object* object = collection.Stack.Pop();
+            if (!object) {
+                // The barrier may find more, they're left for the remark
+                collection.IsMarkerFinished = true;
+                return;
+            }
+            ScanObjectOnce(object, collection);
+        }
+    }
+}
+
+void RememberObject(Object* object, Object* reference) {
+    const ObjectMetadata metadata = GetMetadataForObject(object);
+    if (!metadata || !metadata.IsMarked()) {
+        return;
+    }
+    const ObjectMetadata referenceMetadata = GetMetadataForObject(reference);
+    if (!referenceMetadata || referenceMetadata.IsMarked()) {
+        return;
+    }
+
+    GenerationalCollection& collection = GetGenerationalCollection();
+    std::lock_guard lock(collection.RememberedSetMutex);
+    if (!HasAnyFlags(metadata.Flags(), ObjectFlags::InRememberedSet)) {
+        SetFlag(metadata.Flags(), ObjectFlags::InRememberedSet);
+        collection.RememberedSet.push_back(object);
+    }
+}
+
+// Should be done whenever every live object has been marked, as they're all old then
+void ClearRememberedSet() {
+    GenerationalCollection& collection = GetGenerationalCollection();
+    std::lock_guard lock(collection.RememberedSetMutex);
+    for (Object* object : collection.RememberedSet) {
+        UnsetFlag(GetMetadataForPoolObject(object).Flags(), ObjectFlags::InRememberedSet);
+    }
+    collection.RememberedSet.clear();
+}
+
+bool IsDestroyingUnmarkedObjects() {
+    return GetIncrementalCollection().IsDestroyingUnmarkedObjects.load(std::memory_order_acquire);
+}
+
+// Marks an object the collector may not otherwise find while marking is in progress. Marking
+// is checked again under the lock, as it may have finished since, and an object marked then
+// would never be scanned
+void ShadeObject(Object* object) {
+    if (GetIncrementalCollection().IsMarking) {
+        const ObjectMetadata metadata = GetMetadataForObject(object);
+        if (!metadata || metadata.IsMarked()) {
+            return;
+        }
+        IncrementalCollection& collection = GetIncrementalCollection();
+        std::lock_guard lock(collection.ShadedObjectsMutex);
+        if (collection.IsMarking && metadata.Mark()) {
+            collection.ShadedObjects.push_back(object);
+        }
+    } else if (GetConcurrentCollection().IsMarking) {
+        const ObjectMetadata metadata = GetMetadataForObject(object);
+        if (!metadata || metadata.IsMarked()) {
+            return;
+        }
+        ConcurrentCollection& collection = GetConcurrentCollection();
+        std::lock_guard lock(collection.ScanMutex);
+        if (collection.IsMarking && metadata.Mark()) {
+            collection.Stack.Push(object);
+        }
+    }
+}
+
+void Detail::WriteBarrierSlow(Object* object, Object* /*oldReference*/, Object* newReference) {
+    // Scanning the object covers the old reference, along with anything else it referenced
+    // when marking started
+    if (GetConcurrentCollection().IsMarking) {
+        ScanBeforeWrite(object);
+    }
+
+    if (!newReference) {
+        return;
+    }
+
+    // The object may already have been scanned, so the collector has to be told about
+    // anything it now references
+    if (GetIncrementalCollection().IsMarking) {
+        ShadeObject(newReference);
+    }
+    if (GetGenerationalCollection().IsActive) {
+        RememberObject(object, newReference);
+    }
+}
+
+void ShadeWeakReference(Object* object) {
+    // Only the objects referenced when marking started are kept, one only held weakly then
+    // must be marked before it can be stored
+    if (GetConcurrentCollection().IsMarking) {
+        ShadeObject(object);
+    }
+}
+
+// Runs the incremental collection until it completes or the deadline passes, returning
+// whether it completed
+bool RunIncrementalCollection(const std::chrono::steady_clock::time_point deadline) {
+    IncrementalCollection& collection = GetIncrementalCollection();
+    Array<UniquePtr<ObjectPool>>& pools = ObjectPool::GetPools();
+
+    if (collection.Phase == IncrementalCollectionPhase::Idle) {
+        FinishConcurrentCollection();
+        collection.PoolIndex = 0;
+        collection.Phase = IncrementalCollectionPhase::FinishingSweeps;
+    }
+
+    if (collection.Phase == IncrementalCollectionPhase::FinishingSweeps) {
+        for (; collection.PoolIndex < pools.size(); ++collection.PoolIndex) {
+            if (!pools[collection.PoolIndex]->FinishDeferredSweeps(deadline)) {
+                return false;
+            }
+        }
+
+        // Roots added from here on are shaded as they're added
+        ClearMarks();
+        ObjectPool::SetAllocateMarked(true);
+        std::lock_guard lock(GetRootSetMutex());
+        collection.IsMarking = true;
+        UpdateWriteBarrierEnabled();
+        collection.RootIndex = GetRootSet().size();
+        collection.Phase = IncrementalCollectionPhase::ShadingRoots;
+    }
+
+    if (collection.Phase == IncrementalCollectionPhase::ShadingRoots) {
+        // Removing a root moves the last one into its place, which has already been shaded
+        std::lock_guard lock(GetRootSetMutex());
+        const Array<Object*>& roots = GetRootSet();
+        collection.RootIndex = std::min(collection.RootIndex, roots.size());
+        u32 rootsShaded = 0;
+        while (collection.RootIndex > 0) {
+            Object* object = roots[--collection.RootIndex];
+            const ObjectMetadata metadata = GetMetadataForObject(object);
+            if (metadata && metadata.Mark()) {
+                collection.Stack.Push(object);
+            }
+            if (IsPastDeadline(rootsShaded, deadline)) {
+                return false;
+            }
+        }
+        collection.Phase = IncrementalCollectionPhase::Marking;
+    }
+
+    if (collection.Phase == IncrementalCollectionPhase::Marking) {
+        u32 objectsScanned = 0;
+        while (true) {
+            Object* object = collection.Stack.Pop();
+            if (!object) {
+                std::lock_guard lock(collection.ShadedObjectsMutex);
+                if (collection.ShadedObjects.empty()) {
+                    collection.IsDestroyingUnmarkedObjects = true;
+                    collection.IsMarking = false;
+                    break;
+                }
+                for (Object* shadedObject : collection.ShadedObjects) {
+                    collection.Stack.Push(shadedObject);
+                }
+                collection.ShadedObjects.clear();
                 continue;
             }
 
-            if (HasAnyFlags(header->Flags, ObjectFlags::Unreachable)) {
-                Object* object = (Object*) (header + 1);
-                if (!HasAnyFlags(header->Flags, ObjectFlags::IsBeingDestroyed | ObjectFlags::IsDestroyed)) {
-                    object->Destroy();
+            ScanObjectFields(object, collection.Stack);
+            if (IsPastDeadline(objectsScanned, deadline)) {
+                return false;
+            }
+        }
+
+        UpdateWriteBarrierEnabled();
+        ObjectPool::FlushThreadCache();
+        collection.PoolIndex = 0;
+        collection.BlockIndex = 0;
+        collection.Phase = IncrementalCollectionPhase::KeepingPinnedObjects;
+    }
+
+    if (collection.Phase == IncrementalCollectionPhase::KeepingPinnedObjects) {
+        u32 blocksVisited = 0;
+        for (; collection.PoolIndex < pools.size(); ++collection.PoolIndex, collection.BlockIndex = 0) {
+            Array<ObjectBlock*>& blocks = pools[collection.PoolIndex]->GetBlocks();
+            while (collection.BlockIndex < blocks.size()) {
+                KeepPinnedObjectsInBlock(blocks[collection.BlockIndex++], collection.Stack);
+                if (IsPastDeadline(blocksVisited, deadline)) {
+                    return false;
                 }
-                if (!HasAnyFlags(header->Flags, ObjectFlags::IsDestroyed)) {
-                    object->TryCompleteDestruction();
+            }
+        }
+
+        collection.PoolIndex = 0;
+        collection.BlockIndex = 0;
+        collection.BlocksToSweep.clear();
+        collection.Phase = IncrementalCollectionPhase::Destroying;
+    }
+
+    if (collection.Phase == IncrementalCollectionPhase::Destroying) {
+        // Destroying objects may create new pools and blocks, so don't hold on to iterators
+        for (; collection.PoolIndex < pools.size(); ++collection.PoolIndex, collection.BlockIndex = 0) {
+            Array<ObjectBlock*>& blocks = pools[collection.PoolIndex]->GetBlocks();
+            while (collection.BlockIndex < blocks.size()) {
+                ObjectBlock* block = blocks[collection.BlockIndex++];
+                if (DestroyUnreachableObjectsInBlock(block)) {
+                    collection.BlocksToSweep.emplace_back(block);
+                    if (std::chrono::steady_clock::now() >= deadline) {
+                        return false;
+                    }
                 }
-                if (HasAnyFlags(header->Flags, ObjectFlags::IsDestroyed)) {
-                    pool.DestroyObject(object);
+            }
+        }
+
+        collection.IsDestroyingUnmarkedObjects = false;
+        collection.SweepIndex = 0;
+        collection.Phase = IncrementalCollectionPhase::Sweeping;
+    }
+
+    if (collection.Phase == IncrementalCollectionPhase::Sweeping) {
+        const bool sweepLazily = GetObjectHeapSettings().SweepMode == ObjectSweepMode::Lazy;
+        u32 blocksDeferred = 0;
+        while (collection.SweepIndex < collection.BlocksToSweep.size()) {
+            ObjectBlock* block = collection.BlocksToSweep[collection.SweepIndex++];
+            if (sweepLazily) {
+                block->Pool->DeferSweep(block);
+                if (IsPastDeadline(blocksDeferred, deadline)) {
+                    return false;
                 }
-            } else {
-                // Reset for next GC run
-                SetFlag(header->Flags, ObjectFlags::Unreachable);
+                continue;
+            }
+
+            block->Pool->SweepBlock(block);
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+        }
+
+        collection.PoolIndex = 0;
+        collection.BlockRelease = {};
+        collection.Phase = IncrementalCollectionPhase::ReleasingBlocks;
+    }
+
+    if (collection.Phase == IncrementalCollectionPhase::ReleasingBlocks) {
+        for (; collection.PoolIndex < pools.size(); ++collection.PoolIndex, collection.BlockRelease = {}) {
+            if (!pools[collection.PoolIndex]->ReleaseEmptyBlocks(collection.BlockRelease, deadline)) {
+                return false;
             }
         }
+
+        ObjectPool::SetAllocateMarked(false);
+        ClearRememberedSet();
+        collection.Phase = IncrementalCollectionPhase::Idle;
     }
+    return true;
 }
 
-void CollectGarbage() {
-    // Mark
-    for (Object* object : GetRootSet()) {
-        ObjectHeader* header = GetHeaderForObject(object);
-        if (!header || header->Magic != ObjectHeader::RequiredMagic) {
-            // TODO: This is bad, we should really warn about it
-            continue;
+bool CollectGarbageIncremental(const std::chrono::microseconds budget) {
+    return RunIncrementalCollection(std::chrono::steady_clock::now() + budget);
+}
+
+// Destroys and sweeps every allocated object left unmarked
+void DestroyUnmarkedObjects() {
+    Array<UniquePtr<ObjectPool>>& pools = ObjectPool::GetPools();
+
+    // Destroying objects may create new pools, so don't hold on to iterators
+    ObjectPool::FlushThreadCache();
+    static MarkStack markStack;
+    for (usize index = 0; index < pools.size(); ++index) {
+        for (ObjectBlock* block : pools[index]->GetBlocks()) {
+            KeepPinnedObjectsInBlock(block, markStack);
         }
+    }
+    static Array<ObjectBlock*> blocksToSweep;
+    blocksToSweep.clear();
+    for (usize index = 0; index < pools.size(); ++index) {
+        DestroyUnreachableObjectsInPool(*pools[index], blocksToSweep);
+    }
+
+    // Sweep. Only blocks with garbage in them are visited
+    SweepBlocks(blocksToSweep);
+    ReleaseEmptyBlocks();
+    ClearRememberedSet();
+}
 
-        if (!HasAnyFlags(header->Flags, ObjectFlags::Unreachable)) {
-            // Already traced this object
-            continue;
+// Waits for the concurrent marker if there's one running, then completes its collection
+void FinishConcurrentCollection() {
+    ConcurrentCollection& collection = GetConcurrentCollection();
+    if (!collection.IsMarking) {
+        return;
+    }
+    collection.Marker.join();
+
+    // Remark, scanning whatever the barrier found after the marker ran out of work.
+    // Nothing else can change objects now, so the barrier can be turned off
+    {
+        std::lock_guard lock(collection.ScanMutex);
+        collection.IsMarking = false;
+    }
+    UpdateWriteBarrierEnabled();
+    while (Object* object = collection.Stack.Pop()) {
+        ScanObjectOnce(object, collection);
+    }
+
+    // Everything they reference has been marked, so scanning them again only removes references
+    for (Object* object : collection.ObjectsWithDestroyedReferences) {
+        ScanObjectFields(object, collection.Stack);
+    }
+    collection.ObjectsWithDestroyedReferences.clear();
+
+    DestroyUnmarkedObjects();
+    ObjectPool::SetAllocateMarked(false);
+}
+
+bool CollectGarbageConcurrent() {
+    ConcurrentCollection& collection = GetConcurrentCollection();
+    if (collection.IsMarking) {
+        if (!collection.IsMarkerFinished) {
+            return false;
         }
-        UnsetFlag(header->Flags, ObjectFlags::Unreachable);
-        MarkObjectsReachableFrom(object);
+        FinishConcurrentCollection();
+        return true;
     }
 
-    // Free
-    for (ObjectPool& pool : ObjectPool::GetPools()) {
-        FreeUnreachableObjectsInPool(pool);
+    if (GetIncrementalCollection().Phase != IncrementalCollectionPhase::Idle) {
+        RunIncrementalCollection(std::chrono::steady_clock::time_point::max());
     }
+    FinishDeferredSweeps();
+    ClearMarks();
+
+    ObjectPool::SetAllocateMarked(true);
+    {
+        // Roots added once the lock is released are shaded as they're added
+        std::lock_guard lock(GetRootSetMutex());
+        for (Object* object : GetRootSet()) {
+            const ObjectMetadata metadata = GetMetadataForObject(object);
+            if (metadata && metadata.Mark()) {
+                collection.Stack.Push(object);
+            }
+        }
+        collection.IsMarkerFinished = false;
+        collection.IsMarking = true;
+        UpdateWriteBarrierEnabled();
+    }
+    collection.Marker = std::thread(RunConcurrentMarker, std::ref(collection));
+    return false;
+}
+
+void CollectGarbage() {
+    // An incremental or concurrent collection may be part way through, finish it before starting over
+    if (GetIncrementalCollection().Phase != IncrementalCollectionPhase::Idle) {
+        RunIncrementalCollection(std::chrono::steady_clock::time_point::max());
+    }
+    FinishConcurrentCollection();
+    FinishDeferredSweeps();
+
+    // Mark. There's no point waking more threads than there are blocks of objects
+    const usize blockCount = ClearMarks();
+    MarkFromRootSet(std::clamp<usize>(blockCount, 1, CollectionWorkers::GetThreadCount()));
+
+    DestroyUnmarkedObjects();
+}
+
+void CollectYoungGarbage() {
+    GenerationalCollection& generationalCollection = GetGenerationalCollection();
+    if (!generationalCollection.IsActive || GetIncrementalCollection().Phase != IncrementalCollectionPhase::Idle || GetConcurrentCollection().IsMarking) {
+        // Old to young references written before the barrier was enabled weren't
+        // remembered, so start from a full collection
+        generationalCollection.IsActive = true;
+        UpdateWriteBarrierEnabled();
+        CollectGarbage();
+        return;
+    }
+    FinishDeferredSweeps();
+
+    // Mark. Old objects are already marked, so tracing stops at them
+    static MarkStack markStack;
+    for (Object* object : GetRootSetSnapshot()) {
+        const ObjectMetadata metadata = GetMetadataForObject(object);
+        if (metadata && metadata.Mark()) {
+            markStack.Push(object);
+        }
+    }
+    {
+        std::lock_guard lock(generationalCollection.RememberedSetMutex);
+        for (Object* object : generationalCollection.RememberedSet) {
+            ScanObjectFields(object, markStack);
+        }
+    }
+    while (Object* object = markStack.Pop()) {
+        ScanObjectFields(object, markStack);
+    }
+
+    // Blocks holding only old objects are skipped
+    DestroyUnmarkedObjects();
 }
 
 void AddToRootSet(Object* object) {
-    GetRootSet().push_back(object);
-    SetFlag(GetHeaderForObject(object)->Flags, ObjectFlags::InRootSet);
+    std::lock_guard lock(GetRootSetMutex());
+    ObjectFlags& flags = GetMetadataForPoolObject(object).Flags();
+    if (HasAnyFlags(flags, ObjectFlags::InRootSet)) {
+        return;
+    }
+    Array<Object*>& roots = GetRootSet();
+    GetRootSetIndices().emplace(object, (u32) roots.size());
+    roots.push_back(object);
+    // The roots were already shaded when marking started
+    ShadeObject(object);
+    SetFlag(flags, ObjectFlags::InRootSet);
 }
 
 void RemoveFromRootSet(Object* object) {
+    std::lock_guard lock(GetRootSetMutex());
+    ObjectFlags& flags = GetMetadataForPoolObject(object).Flags();
+    if (!HasAnyFlags(flags, ObjectFlags::InRootSet)) {
+        return;
+    }
     Array<Object*>& roots = GetRootSet();
-    roots.erase(std::remove(roots.begin(), roots.end(), object), roots.end());
-    UnsetFlag(GetHeaderForObject(object)->Flags, ObjectFlags::InRootSet);
+    Map<Object*, u32>& indices = GetRootSetIndices();
+    const auto it = indices.find(object);
+    const u32 index = it->second;
+    indices.erase(it);
+    if (index != roots.size() - 1) {
+        roots[index] = roots.back();
+        indices[roots[index]] = index;
+    }
+    roots.pop_back();
+    UnsetFlag(flags, ObjectFlags::InRootSet);
 }
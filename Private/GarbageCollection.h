@@ -1,7 +1,15 @@
 #pragma once
 
+#include <chrono>
+
 struct Object;
 
 void CollectGarbage();
+void CollectYoungGarbage();
+bool CollectGarbageIncremental(std::chrono::microseconds budget);
+bool CollectGarbageConcurrent();
+void ShadeWeakReference(Object* object);
+// While an incremental collection is destroying unreachable objects, unmarked ones are garbage
+bool IsDestroyingUnmarkedObjects();
 void AddToRootSet(Object* object);
 void RemoveFromRootSet(Object* object);
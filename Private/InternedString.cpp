@@ -0,0 +1,84 @@
+#include "Object/InternedString.h"
+#include "ObjectStatics.h"
+
+#include <array>
+#include <bit>
+#include <mutex>
+#include <shared_mutex>
+
+// Strings are stored in chunks which are never moved or freed, so they can be read without
+// the lock and the lookup can key on views of them. Each chunk is twice the size of the one
+// before, so there are always enough of them for every id
+struct InternedStringTable {
+    static constexpr u32 FirstChunkSize = 1024;
+    static constexpr u32 ChunkCount = std::bit_width(u32_max / FirstChunkSize + 1);
+
+    // Lookups share the lock, only adding a string needs it to itself
+    std::shared_mutex Mutex;
+    Map<std::string_view, u32> Ids;
+    std::array<UniquePtr<String[]>, ChunkCount> Chunks;
+    u32 Count = 0;
+
+    InternedStringTable() {
+        // Id 0 is the empty string, which is what default constructed strings are
+        Add({});
+    }
+
+    // Chunk n holds FirstChunkSize << n strings, starting from id FirstChunkSize * (2^n - 1)
+    static u32 GetChunkIndex(const u32 id) {
+        return std::bit_width(id / FirstChunkSize + 1) - 1;
+    }
+    static u32 GetChunkStart(const u32 chunkIndex) {
+        return FirstChunkSize * ((1u << chunkIndex) - 1);
+    }
+
+    const String& Get(const u32 id) const {
+        const u32 chunkIndex = GetChunkIndex(id);
+        return Chunks[chunkIndex][id - GetChunkStart(chunkIndex)];
+    }
+
+    u32 Add(const std::string_view string) {
+        const u32 id = Count++;
+        const u32 chunkIndex = GetChunkIndex(id);
+        UniquePtr<String[]>& chunk = Chunks[chunkIndex];
+        if (!chunk) {
+            chunk = MakeUnique<String[]>(FirstChunkSize << chunkIndex);
+        }
+        String& storedString = chunk[id - GetChunkStart(chunkIndex)];
+        storedString = string;
+        Ids.emplace(storedString, id);
+        return id;
+    }
+};
+
+InternedStringTable& GetInternedStringTable() {
+    return GetNeverDestroyed<InternedStringTable>();
+}
+
+InternedString::InternedString(const std::string_view string) {
+    // Most strings interned are names that already have been
+    *this = Find(string);
+    if (!IsEmpty() || string.empty()) {
+        return;
+    }
+
+    InternedStringTable& table = GetInternedStringTable();
+    std::unique_lock lock(table.Mutex);
+    const auto it = table.Ids.find(string);
+    id = it != table.Ids.end() ? it->second : table.Add(string);
+}
+
+InternedString InternedString::Find(const std::string_view string) {
+    InternedStringTable& table = GetInternedStringTable();
+    std::shared_lock lock(table.Mutex);
+    const auto it = table.Ids.find(string);
+    InternedString internedString;
+    if (it != table.Ids.end()) {
+        internedString.id = it->second;
+    }
+    return internedString;
+}
+
+const String& InternedString::ToString() const {
+    return GetInternedStringTable().Get(id);
+}
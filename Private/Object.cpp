@@ -1,12 +1,14 @@
 #include "Object/Object.h"
 #include "GarbageCollection.h"
 #include "ObjectPool.h"
+#include "BlockArena.h"
 
 Object::~Object() {
 }
 
 ObjectFlags Object::GetFlags() const {
-    return GetHeaderForObject(this)->Flags;
+    const ObjectMetadata metadata = GetMetadataForObject(this);
+    return metadata ? metadata.Flags() : ObjectFlags::None;
 }
 
 const Array<UniquePtr<ObjectField>>& Object::GetObjectFields() const {
@@ -28,19 +30,21 @@ void Object::RemoveFromRootSet() {
 }
 
 void Object::Destroy() {
-    ObjectHeader* header = GetHeaderForObject(this);
-    SetFlag(header->Flags, ObjectFlags::IsBeingDestroyed);
-    UnsetFlag(header->Flags, ObjectFlags::IsDestroyed);
+    const ObjectMetadata metadata = GetMetadataForPoolObject(this);
+    metadata.Block->SetDying(metadata.Slot);
+    ObjectFlags& flags = metadata.Flags();
+    SetFlag(flags, ObjectFlags::IsBeingDestroyed);
+    UnsetFlag(flags, ObjectFlags::IsDestroyed);
     OnBeginDestroy();
     TryCompleteDestruction();
 }
 
 void Object::TryCompleteDestruction() {
-    ObjectHeader* header = GetHeaderForObject(this);
-    if (HasAnyFlags(header->Flags, ObjectFlags::IsBeingDestroyed) && IsDestroyFinished()) {
+    ObjectFlags& flags = GetMetadataForPoolObject(this).Flags();
+    if (HasAnyFlags(flags, ObjectFlags::IsBeingDestroyed) && IsDestroyFinished()) {
         OnEndDestroy();
-        SetFlag(header->Flags, ObjectFlags::IsDestroyed);
-        UnsetFlag(header->Flags, ObjectFlags::IsBeingDestroyed);
+        SetFlag(flags, ObjectFlags::IsDestroyed);
+        UnsetFlag(flags, ObjectFlags::IsBeingDestroyed);
     }
 }
 
@@ -55,13 +59,26 @@ void Object::OnEndDestroy() {
 }
 
 u32 Object::GetGeneration() const {
-    return GetHeaderForObject(this)->Generation;
+    const ObjectMetadata metadata = GetMetadataForObject(this);
+    return metadata ? metadata.Generation() : 0;
 }
 
 void Object::CollectGarbage() {
     ::CollectGarbage();
 }
 
+void Object::CollectYoungGarbage() {
+    ::CollectYoungGarbage();
+}
+
+bool Object::CollectGarbageConcurrent() {
+    return ::CollectGarbageConcurrent();
+}
+
+bool Object::CollectGarbageIncremental(const std::chrono::microseconds budget) {
+    return ::CollectGarbageIncremental(budget);
+}
+
 void* Detail::AllocObject(const u32 objectSize) {
     return ObjectPool::AllocateObject(objectSize);
 }
@@ -71,12 +88,20 @@ Object* NewObject(Class* objectClass) {
         return NewObject<Class>();
     }
 
-    Object* object = (Object*) Detail::AllocObject(objectClass->Size());
+    // The collector needs the class's reference offsets once it has objects
+    objectClass->EnsureFieldsRegistered();
+    ObjectPool* pool = objectClass->pool ? objectClass->pool : ObjectPool::GetPoolForObjectSize(objectClass->Size());
+    if (!pool) {
+        return nullptr;
+    }
+
+    Object* object = (Object*) pool->Allocate();
     if (!object) {
         return nullptr;
     }
     objectClass->Construct(object);
     object->classInstance = objectClass;
+    objectClass->AddInstance(object);
     return object;
 }
 
@@ -90,31 +115,124 @@ Class* NewObject<Class>() {
     return (Class*) object;
 }
 
+bool IsLiveObject(const ObjectMetadata metadata) {
+    const ObjectFlags flags = metadata.Flags();
+    return HasAnyFlags(flags, ObjectFlags::Allocated) && !HasAnyFlags(flags, ObjectFlags::IsBeingDestroyed | ObjectFlags::IsDestroyed);
+}
+
 bool IsValid(const Object* object) {
     if (object == nullptr) {
         return false;
     }
 
-    const ObjectFlags flags = GetHeaderForObject(object)->Flags;
-    return HasAnyFlags(flags, ObjectFlags::Allocated) && !HasAnyFlags(flags, ObjectFlags::IsBeingDestroyed | ObjectFlags::IsDestroyed);
+    const ObjectMetadata metadata = GetMetadataForObject(object);
+    return metadata && IsLiveObject(metadata);
+}
+
+// Handles are laid out as [arena unit + 1: 32][slot: 16][generation: 16], so an empty
+// handle is never a valid one. Blocks hold at most BlockSize / 16 slots, which fits
+static constexpr u32 HandleSlotShift = 16;
+static constexpr u32 HandleUnitShift = 32;
+
+ObjectMetadata GetMetadataForHandle(const ObjectHandle handle) {
+    const BlockArena& arena = BlockArena::Get();
+    const u64 unit = (handle.Value >> HandleUnitShift) - 1;
+    if (!handle || unit >= arena.GetUnitCount()) {
+        return {};
+    }
+
+    // Callers hold a BlockArena::ReadScope, so the block can't be released while it's read
+    ObjectBlock* block = (ObjectBlock*) arena.GetUnitAddress((u32) unit);
+    const u32 slot = (u32)(handle.Value >> HandleSlotShift) & u16_max;
+    if (!arena.IsBlockStart(block) || slot >= block->SlotCount || !block->IsAllocated(slot) || block->GetGeneration(slot) != (u16) handle.Value) {
+        return {};
+    }
+    return { block, slot };
 }
 
-WeakObjectPtrBase::WeakObjectPtrBase(Object* object) {
-    if (::IsValid(object)) {
-        this->object = object;
-        this->generation = GetHeaderForObject(object)->Generation;
+ObjectHandle GetHandleForMetadata(const ObjectMetadata metadata) {
+    const u64 unit = BlockArena::Get().GetUnitIndex(metadata.Block) + 1;
+    return { unit << HandleUnitShift | u64(metadata.Slot) << HandleSlotShift | metadata.Generation() };
+}
+
+ObjectHandle GetObjectHandle(const Object* object) {
+    if (!IsValid(object)) {
+        return {};
     }
+    return GetHandleForMetadata(GetMetadataForPoolObject(object));
 }
 
+Object* ResolveObjectHandle(const ObjectHandle handle) {
+    BlockArena::ReadScope readScope;
+    const ObjectMetadata metadata = GetMetadataForHandle(handle);
+    if (!metadata || !IsLiveObject(metadata)) {
+        return nullptr;
+    }
+    // Anything it's stored in wouldn't keep it, it's about to be destroyed
+    if (IsDestroyingUnmarkedObjects() && !metadata.IsMarked()) [[unlikely]] {
+        return nullptr;
+    }
+    return metadata.Block->GetObject(metadata.Slot);
+}
+
+WeakObjectPtrBase::WeakObjectPtrBase(Object* object)
+    : handle(GetObjectHandle(object))
+{}
+
 bool WeakObjectPtrBase::IsValid() const {
-    return ::IsValid(object) && GetHeaderForObject(object)->Generation == generation;
+    return ResolveObjectHandle(handle) != nullptr;
 }
 
 const Object* WeakObjectPtrBase::Get() const {
-    return IsValid() ? object : nullptr;
+    Object* object = ResolveObjectHandle(handle);
+    if (object) {
+        ShadeWeakReference(object);
+    }
+    return object;
 }
 Object* WeakObjectPtrBase::Get() {
-    return IsValid() ? object : nullptr;
+    Object* object = ResolveObjectHandle(handle);
+    if (object) {
+        ShadeWeakReference(object);
+    }
+    return object;
+}
+
+ObjectPinBase::ObjectPinBase(const ObjectHandle handle) {
+    // Once pinned, the block can't be released until the pin goes away
+    BlockArena::ReadScope readScope;
+    const ObjectMetadata metadata = GetMetadataForHandle(handle);
+    if (metadata && metadata.Block->TryPin(metadata.Slot, (u16) handle.Value)) {
+        object = metadata.Block->GetObject(metadata.Slot);
+        ShadeWeakReference(object);
+    }
+}
+
+ObjectPinBase::ObjectPinBase(ObjectPinBase&& other) noexcept
+    : object(other.object)
+{
+    other.object = nullptr;
+}
+
+ObjectPinBase& ObjectPinBase::operator=(ObjectPinBase&& other) noexcept {
+    if (this != &other) {
+        Unpin();
+        object = other.object;
+        other.object = nullptr;
+    }
+    return *this;
+}
+
+ObjectPinBase::~ObjectPinBase() {
+    Unpin();
+}
+
+void ObjectPinBase::Unpin() {
+    if (object) {
+        const ObjectMetadata metadata = GetMetadataForPoolObject(object);
+        metadata.Block->Unpin(metadata.Slot);
+        object = nullptr;
+    }
 }
 
 struct StrongObjectPtrManager : Object {
@@ -123,44 +241,45 @@ struct StrongObjectPtrManager : Object {
         EXPOSE_FIELD(objects);
     }
 
+    // Released slots are reused most recently released first. Strong pointers are made and
+    // dropped on any thread, so both lock
     i32 Register(Object* object) {
-        const i32 numberOfObjects = objects.size();
-        for (i32 index = 0; index < numberOfObjects; ++index) {
-            if (objects[index] == nullptr) {
-                objects[index] = object;
-                return index;
-            }
+        std::lock_guard lock(mutex);
+        WriteBarrier(nullptr, object);
+        if (!freeIndices.empty()) {
+            const i32 index = freeIndices.back();
+            freeIndices.pop_back();
+            objects[index] = object;
+            return index;
         }
 
         objects.push_back(object);
-        return numberOfObjects;
+        return (i32) objects.size() - 1;
     }
 
     void Unregister(i32 index) {
+        std::lock_guard lock(mutex);
         if (index >= 0 && index < objects.size()) {
+            WriteBarrier(objects[index], nullptr);
             objects[index] = nullptr;
-
-            // Try to shrink the array if possible
-            auto nextAssignedObjectIt = std::find_if(objects.begin() + index, objects.end(), [](const Object* object) {
-                return object != nullptr;
-            });
-            if (nextAssignedObjectIt == objects.end()) {
-                objects.erase(objects.begin() + index, objects.end());
-            }
+            freeIndices.push_back(index);
         }
     }
 
     Array<Object*> objects;
+    Array<i32> freeIndices;
+    std::mutex mutex;
 };
 
 DECLARE_OBJECT(StrongObjectPtrManager)
 IMPL_OBJECT(StrongObjectPtrManager, Object)
 
 StrongObjectPtrManager* StaticStrongObjectPtrManager() {
-    static StrongObjectPtrManager* instance = NewObject<StrongObjectPtrManager>();
-    if (!HasAnyFlags(instance->GetFlags(), ObjectFlags::InRootSet)) {
-        instance->AddToRootSet();
-    }
+    static StrongObjectPtrManager* instance = []{
+        StrongObjectPtrManager* manager = NewObject<StrongObjectPtrManager>();
+        manager->AddToRootSet();
+        return manager;
+    }();
     return instance;
 }
 
@@ -169,6 +288,38 @@ StrongObjectPtrBase::StrongObjectPtrBase(Object* object)
       index(StaticStrongObjectPtrManager()->Register(object))
 {}
 
+StrongObjectPtrBase::StrongObjectPtrBase(const StrongObjectPtrBase& other)
+    : StrongObjectPtrBase(other.object)
+{}
+
+StrongObjectPtrBase::StrongObjectPtrBase(StrongObjectPtrBase&& other) noexcept
+    : object(other.object),
+      index(other.index)
+{
+    other.object = nullptr;
+    other.index = -1;
+}
+
+StrongObjectPtrBase& StrongObjectPtrBase::operator=(const StrongObjectPtrBase& other) {
+    if (this != &other) {
+        StaticStrongObjectPtrManager()->Unregister(index);
+        object = other.object;
+        index = StaticStrongObjectPtrManager()->Register(object);
+    }
+    return *this;
+}
+
+StrongObjectPtrBase& StrongObjectPtrBase::operator=(StrongObjectPtrBase&& other) noexcept {
+    if (this != &other) {
+        StaticStrongObjectPtrManager()->Unregister(index);
+        object = other.object;
+        index = other.index;
+        other.object = nullptr;
+        other.index = -1;
+    }
+    return *this;
+}
+
 StrongObjectPtrBase::~StrongObjectPtrBase() {
     StaticStrongObjectPtrManager()->Unregister(index);
 }
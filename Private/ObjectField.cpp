@@ -10,29 +10,54 @@ ObjectField::ObjectField(const ObjectFieldType type, const u32 offset, const Str
 ObjectField::ObjectField(const ObjectFieldType type, const u32 offset, String&& name)
     : Type(type),
       Offset(offset),
-      Name(Move(name))
+      Name(name)
 {}
 
-bool ObjectField::HasTag(const String& tag) const {
-    return tags.find(tag) != tags.end();
+bool ObjectField::HasTag(const InternedString tag) const {
+    for (const auto& [key, value] : tags) {
+        if (key == tag) {
+            return true;
+        }
+    }
+    return false;
 }
 
-const String& ObjectField::GetTag(const String& tag) const {
-    auto it = tags.find(tag);
-    if (it != tags.end()) {
-        return it->second;
-    }
+bool ObjectField::HasTag(const std::string_view tag) const {
+    const InternedString internedTag = InternedString::Find(tag);
+    return !internedTag.IsEmpty() && HasTag(internedTag);
+}
+
+static const String& GetMissingTag() {
     static String missingTag{};
     return missingTag;
 }
 
-ObjectField* ObjectField::WithTag(const String& tag, const String& value) {
-    tags.emplace(tag, value);
+const String& ObjectField::GetTag(const InternedString tag) const {
+    for (const auto& [key, value] : tags) {
+        if (key == tag) {
+            return value;
+        }
+    }
+    return GetMissingTag();
+}
+
+const String& ObjectField::GetTag(const std::string_view tag) const {
+    const InternedString internedTag = InternedString::Find(tag);
+    return !internedTag.IsEmpty() ? GetTag(internedTag) : GetMissingTag();
+}
+
+// Tags which are already set keep their first value
+ObjectField* ObjectField::WithTag(const InternedString tag, const String& value) {
+    if (!HasTag(tag)) {
+        tags.emplace_back(tag, value);
+    }
     return this;
 }
 
-ObjectField* ObjectField::WithTag(String&& tag, String&& value) {
-    tags.emplace(Move(tag), Move(value));
+ObjectField* ObjectField::WithTag(const InternedString tag, String&& value) {
+    if (!HasTag(tag)) {
+        tags.emplace_back(tag, Move(value));
+    }
     return this;
 }
 
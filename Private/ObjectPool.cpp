@@ -1,122 +1,588 @@
 #include "ObjectPool.h"
+#include "Object/ObjectHeap.h"
 
-Array<ObjectPool>& ObjectPool::GetPools() {
-    static Array<ObjectPool> pools;
+#include <algorithm>
+
+static_assert(ObjectPool::GetPoolSizeForSizeClass(ObjectPool::NumberOfSizeClasses - 1) == ObjectPool::MaxPooledObjectSize, "The largest size class should hold the largest pooled object");
+
+Array<UniquePtr<ObjectPool>>& ObjectPool::GetPools() {
+    static Array<UniquePtr<ObjectPool>> pools;
     return pools;
 }
 
-ObjectHeader* GetHeaderForObject(const Object* object) {
-    ObjectHeader* header = (ObjectHeader*)((u8*) object - sizeof(ObjectHeader));
+std::mutex& ObjectPool::GetPoolsMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
 
-    if (header->Magic != ObjectHeader::RequiredMagic) {
-        return nullptr;
+std::array<std::atomic<ObjectPool*>, ObjectPool::NumberOfSizeClasses>& ObjectPool::GetPoolsBySizeClass() {
+    static std::array<std::atomic<ObjectPool*>, NumberOfSizeClasses> poolsBySizeClass{};
+    return poolsBySizeClass;
+}
+
+// Free slots handed to a thread, per size class
+struct ThreadObjectCache {
+    std::array<FreeSlot*, ObjectPool::NumberOfSizeClasses> FreeLists{};
+
+    ~ThreadObjectCache() {
+        Flush();
     }
 
-    return header;
+    void Flush() {
+        for (FreeSlot*& freeList : FreeLists) {
+            if (freeList) {
+                GetBlockForObject((Object*) freeList)->Pool->FreeBatch(freeList);
+                freeList = nullptr;
+            }
+        }
+    }
+};
+
+static ThreadObjectCache& GetThreadObjectCache() {
+    thread_local ThreadObjectCache cache;
+    return cache;
+}
+
+ObjectHeapSettings& GetObjectHeapSettings() {
+    static ObjectHeapSettings settings;
+    return settings;
+}
+
+ObjectHeapStats GetObjectHeapStats() {
+    ObjectHeapStats stats;
+    stats.ReservedBytes = BlockArena::Get().GetReservedSize();
+    stats.CommittedBytes = BlockArena::Get().GetCommittedSize();
+    std::lock_guard poolsLock(ObjectPool::GetPoolsMutex());
+    for (const UniquePtr<ObjectPool>& pool : ObjectPool::GetPools()) {
+        std::lock_guard lock(pool->GetMutex());
+        stats.BlockCount += pool->GetBlocks().size();
+    }
+    return stats;
 }
 
-ObjectPool::ObjectPool(const u32 poolElementSize)
-    : PoolElementSize(poolElementSize)
+void SetBlocksPerGrowthForClass(Class* objectClass, const u32 initialBlocksPerGrowth, const u32 maxBlocksPerGrowth) {
+    if (ObjectPool* pool = ObjectPool::GetPoolForObjectSize(objectClass->Size())) {
+        pool->SetBlocksPerGrowth(initialBlocksPerGrowth, maxBlocksPerGrowth);
+    }
+}
+
+ObjectMetadata GetMetadataForObject(const Object* object) {
+    ObjectBlock* block = ObjectPool::FindBlockContainingObject(object);
+    if (!block) {
+        return {};
+    }
+    return { block, block->GetSlotIndex(object) };
+}
+
+bool ObjectBlock::ContainsSlotFor(const Object* object) const {
+    const u8* address = (const u8*) object;
+    if (address < Slots) {
+        return false;
+    }
+
+    const u64 offset = address - Slots;
+    return offset < (u64) InitialisedSlotCount * SlotStride && offset % SlotStride == 0;
+}
+
+ObjectPool::ObjectPool(const u32 sizeClass)
+    : PoolElementSize(GetPoolSizeForSizeClass(sizeClass)),
+      SizeClass(sizeClass)
 {}
 
+void ObjectPool::SetBlocksPerGrowth(const u32 initialBlocksPerGrowth, const u32 maxBlocksPerGrowth) {
+    std::lock_guard lock(Mutex);
+    InitialBlocksPerGrowth = initialBlocksPerGrowth;
+    MaxBlocksPerGrowth = maxBlocksPerGrowth;
+    BlocksPerGrowth = 0;
+}
+
 void* ObjectPool::Allocate() {
-    if (!FreeListHeader) {
-        AllocateBlock();
-        if (!FreeListHeader) {
-            return nullptr;
+    FreeSlot*& freeList = GetThreadObjectCache().FreeLists[SizeClass];
+    if (!freeList && !AllocateBatch(freeList, GetThreadCacheBatchSize())) {
+        return nullptr;
+    }
+
+    Object* object = (Object*) freeList;
+    freeList = freeList->Next;
+
+    ObjectBlock* block = GetBlockForObject(object);
+    const u32 slot = block->GetSlotIndex(object);
+    block->NextGeneration(slot);
+    // Reset everything, slots are reused so the flags from the previous object may still be set
+    block->Flags[slot] = ObjectFlags::Allocated;
+    block->SetAllocated(slot, true);
+    if (AllocateMarked.load(std::memory_order_relaxed)) [[unlikely]] {
+        block->Mark(slot);
+    }
+
+    return object;
+}
+
+u32 ObjectPool::AllocateBatch(FreeSlot*& slots, const u32 count) {
+    std::lock_guard lock(Mutex);
+
+    u32 allocated = 0;
+    FreeSlot* last = nullptr;
+    while (allocated < count) {
+        ObjectBlock* block = FirstAvailableBlock;
+        if (!block && !AllocateBlocks()) {
+            break;
         }
+        block = FirstAvailableBlock;
+        if (block->SweepPending) {
+            SweepDeferredBlock(block);
+            if (!block->HasFreeSlots()) {
+                RemoveAvailableBlock(block);
+                continue;
+            }
+        }
+
+        FreeSlot* slot = block->FreeList;
+        if (slot) {
+            block->FreeList = slot->Next;
+        } else {
+            const u32 slotIndex = block->InitialisedSlotCount++;
+            slot = (FreeSlot*) block->GetObject(slotIndex);
+            std::atomic_ref<u16>(block->Generations[slotIndex]).store(block->FirstGeneration, std::memory_order_relaxed);
+            block->Flags[slotIndex] = ObjectFlags::None;
+            block->InstanceLinks[slotIndex] = nullptr;
+        }
+
+        // Slots held by a thread cache count as live, so their block won't be released
+        block->LiveCount++;
+        if (!block->HasFreeSlots()) {
+            RemoveAvailableBlock(block);
+        }
+
+        slot->Next = nullptr;
+        if (last) {
+            last->Next = slot;
+        } else {
+            slots = slot;
+        }
+        last = slot;
+        allocated++;
     }
+    return allocated;
+}
 
-    ObjectHeader* header = FreeListHeader;
-    FreeListHeader = FreeListHeader->NextFree;
-    header->Generation++;
-    SetFlag(header->Flags, ObjectFlags::Allocated);
-    SetFlag(header->Flags, ObjectFlags::Unreachable);
-    header->NextFree = nullptr;
+void ObjectPool::FreeBatch(FreeSlot* slots) {
+    std::lock_guard lock(Mutex);
 
-    return header + 1;
+    while (slots) {
+        FreeSlot* slot = slots;
+        slots = slots->Next;
+
+        ObjectBlock* block = GetBlockForObject((Object*) slot);
+        slot->Next = block->FreeList;
+        block->FreeList = slot;
+        block->LiveCount--;
+        AddAvailableBlock(block, true);
+    }
 }
 
-void ObjectPool::Free(Object* object) {
-    ObjectHeader* header = GetHeaderForObject(object);
-    if (header) {
-        header->Generation++;
-        UnsetFlag(header->Flags, ObjectFlags::Allocated);
-        UnsetFlag(header->Flags, ObjectFlags::Unreachable);
-        header->NextFree = FreeListHeader;
-        FreeListHeader = header;
+void ObjectPool::TakeOffNewInstances(Object* object) {
+    // Its class's list of new objects may still link through the slot
+    const ObjectMetadata metadata = GetMetadataForPoolObject(object);
+    if (std::atomic_ref<Object*>(metadata.Block->InstanceLinks[metadata.Slot]).load(std::memory_order_acquire)) {
+        Class* objectClass = object->GetClass();
+        std::lock_guard lock(objectClass->instancesMutex);
+        objectClass->TakeNewInstances();
     }
 }
 
-bool ObjectPool::ContainsObject(Object* object) const {
-    u8* address = (u8*) object;
-    for (const Array<u8>& block : Blocks) {
-        if (block.data() < address && address < (block.data() + block.size())) {
-            return true;
+FreeSlot* ObjectPool::ReclaimDestroyedObjects(ObjectBlock* block, FreeSlot*& lastSlot, u32& slotCount) {
+    FreeSlot* firstSlot = nullptr;
+    lastSlot = nullptr;
+    slotCount = 0;
+    for (u32 word = 0; word < block->BitmapWordCount; ++word) {
+        u64 unreachable = block->AllocatedBits[word] & ~block->GetMarkWord(word);
+        while (unreachable) {
+            const u32 slot = word * 64 + std::countr_zero(unreachable);
+            unreachable &= unreachable - 1;
+
+            // Objects still being destroyed or still pinned are kept until a later collection
+            if (!HasAnyFlags(block->Flags[slot], ObjectFlags::IsDestroyed) || !block->TrySetDying(slot)) {
+                continue;
+            }
+
+            Object* object = block->GetObject(slot);
+            TakeOffNewInstances(object);
+            object->~Object();
+            block->NextGeneration(slot);
+            block->ResetPins(slot);
+            UnsetFlag(block->Flags[slot], ObjectFlags::Allocated);
+            block->SetAllocated(slot, false);
+
+            FreeSlot* freeSlot = (FreeSlot*) object;
+            freeSlot->Next = firstSlot;
+            firstSlot = freeSlot;
+            if (!lastSlot) {
+                lastSlot = freeSlot;
+            }
+            slotCount++;
         }
     }
-    return false;
+    return firstSlot;
 }
 
-u32 ObjectPool::GetPoolSizeForObjectSize(const u32 objectSize) {
-    return objectSize;
+void ObjectPool::AddFreeSlots(ObjectBlock* block, FreeSlot* firstSlot, FreeSlot* lastSlot, const u32 slotCount) {
+    if (!firstSlot) {
+        return;
+    }
+
+    lastSlot->Next = block->FreeList;
+    block->FreeList = firstSlot;
+    block->LiveCount -= slotCount;
+    AddAvailableBlock(block, true);
 }
 
-ObjectPool* ObjectPool::FindObjectPoolContainingObject(Object* object) {
-    Array<ObjectPool>& pools = GetPools();
-    auto it = std::find_if(pools.begin(), pools.end(), [object](const ObjectPool& pool) {
-        return pool.ContainsObject(object);
-    });
+void ObjectPool::SweepBlock(ObjectBlock* block) {
+    FreeSlot* lastSlot;
+    u32 slotCount;
+    FreeSlot* firstSlot = ReclaimDestroyedObjects(block, lastSlot, slotCount);
 
-    if (it == pools.end()) {
-        return nullptr;
+    std::lock_guard lock(Mutex);
+    AddFreeSlots(block, firstSlot, lastSlot, slotCount);
+}
+
+void ObjectPool::DeferSweep(ObjectBlock* block) {
+    std::lock_guard lock(Mutex);
+    if (block->SweepPending) {
+        return;
     }
 
-    return &*it;
+    block->SweepPending = true;
+    DeferredSweepBlocks.emplace_back(block);
+    // To the front, so the allocator reaches it before growing
+    RemoveAvailableBlock(block);
+    AddAvailableBlock(block, true);
+}
+
+void ObjectPool::SweepDeferredBlock(ObjectBlock* block) {
+    block->SweepPending = false;
+
+    FreeSlot* lastSlot;
+    u32 slotCount;
+    FreeSlot* firstSlot = ReclaimDestroyedObjects(block, lastSlot, slotCount);
+    AddFreeSlots(block, firstSlot, lastSlot, slotCount);
+}
+
+bool ObjectPool::FinishDeferredSweeps(const std::chrono::steady_clock::time_point deadline) {
+    std::lock_guard lock(Mutex);
+    while (!DeferredSweepBlocks.empty()) {
+        ObjectBlock* block = DeferredSweepBlocks.back();
+        DeferredSweepBlocks.pop_back();
+        if (!block->SweepPending) {
+            continue;
+        }
+
+        SweepDeferredBlock(block);
+        if (!block->HasFreeSlots()) {
+            RemoveAvailableBlock(block);
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return DeferredSweepBlocks.empty();
+        }
+    }
+    return true;
 }
 
-void* ObjectPool::AllocateObject(u32 objectSize) {
+u32 ObjectPool::GetThreadCacheBatchSize() const {
+    return std::clamp<u32>(ThreadCacheBatchBytes / PoolElementSize, 1, MaxThreadCacheBatchSize);
+}
+
+void ObjectPool::FlushThreadCache() {
+    GetThreadObjectCache().Flush();
+}
+
+bool ObjectPool::ReleaseEmptyBlocks(EmptyBlockRelease& progress, const std::chrono::steady_clock::time_point deadline) {
+    std::lock_guard lock(Mutex);
+    const ObjectHeapSettings& settings = GetObjectHeapSettings();
+
+    u32 blocksVisited = 0;
+    if (!progress.IsReleasing) {
+        while (progress.BlockIndex < Blocks.size()) {
+            ObjectBlock* block = Blocks[progress.BlockIndex++];
+            if (block->LiveCount == 0) {
+                block->EmptySweepCount++;
+                progress.EmptyBlockCount++;
+                // Move it to the back so allocation prefers the blocks still in use
+                RemoveAvailableBlock(block);
+                AddAvailableBlock(block, false);
+            } else {
+                block->EmptySweepCount = 0;
+            }
+            if (IsPastDeadline(blocksVisited, deadline)) {
+                return false;
+            }
+        }
+
+        const u32 blocksInUse = (u32) Blocks.size() - std::min<u32>(progress.EmptyBlockCount, (u32) Blocks.size());
+        const u32 retainedEmptyBlocks = std::max(settings.MinRetainedEmptyBlocks, (u32)(blocksInUse * settings.RetainedEmptyBlockRatio));
+        if (progress.EmptyBlockCount <= retainedEmptyBlocks) {
+            return true;
+        }
+
+        progress.BlocksToRelease = progress.EmptyBlockCount - retainedEmptyBlocks;
+        progress.BlockIndex = Blocks.size();
+        progress.IsReleasing = true;
+    }
+
+    // Blocks are only added to the end between calls, so the index is still in range
+    while (progress.BlockIndex > 0 && progress.BlocksToRelease > 0) {
+        ObjectBlock* block = Blocks[--progress.BlockIndex];
+        if (block->LiveCount == 0 && block->EmptySweepCount >= settings.SweepsBeforeReleasingEmptyBlocks) {
+            // Anything swapped in from the back has already been looked at, or is new since
+            // the release started and can wait for the next one
+            Blocks[progress.BlockIndex] = Blocks.back();
+            Blocks.pop_back();
+            ReleaseBlock(block);
+            progress.BlocksToRelease--;
+            // Decommitting is slow enough to check after every block
+            if (progress.BlocksToRelease > 0 && std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+        } else if (IsPastDeadline(blocksVisited, deadline)) {
+            return false;
+        }
+    }
+
+    // The pool has shrunk, so don't grow back as aggressively
+    BlocksPerGrowth /= 2;
+    return true;
+}
+
+u32 ObjectPool::GetSizeClassForObjectSize(u32 objectSize) {
     if (objectSize == 0) [[unlikely]] {
         objectSize = 1;
     }
 
-    Array<ObjectPool>& pools = GetPools();
-    const u32 poolSizeForAllocation = GetPoolSizeForObjectSize(objectSize);
-    auto it = std::find_if(pools.begin(), pools.end(), [poolSizeForAllocation](const ObjectPool& pool) {
-        return pool.PoolElementSize == poolSizeForAllocation;
-    });
+    if (objectSize <= SmallSizeClassLimit) {
+        return (objectSize - 1) / SmallSizeClassGranularity;
+    }
+
+    // Find the power of two range (2^k, 2^(k+1)] the size falls into, then which quarter of it
+    const u32 powerOfTwo = std::bit_width(objectSize - 1) - 1;
+    const u32 stepShift = powerOfTwo - std::bit_width(SizeClassesPerPowerOfTwo - 1);
+    const u32 step = ((objectSize - 1) - (1u << powerOfTwo)) >> stepShift;
+    const u32 smallSizeClasses = SmallSizeClassLimit / SmallSizeClassGranularity;
+    const u32 firstLargePowerOfTwo = std::bit_width(SmallSizeClassLimit) - 1;
+    return smallSizeClasses + (powerOfTwo - firstLargePowerOfTwo) * SizeClassesPerPowerOfTwo + step;
+}
+
+u32 ObjectPool::GetPoolSizeForObjectSize(const u32 objectSize) {
+    return GetPoolSizeForSizeClass(GetSizeClassForObjectSize(objectSize));
+}
+
+ObjectPool* ObjectPool::GetPoolForObjectSize(const u32 objectSize) {
+    if (objectSize > MaxPooledObjectSize) [[unlikely]] {
+        return nullptr;
+    }
 
-    if (it == pools.end()) {
-        it = pools.emplace(pools.end(), poolSizeForAllocation);
+    const u32 sizeClass = GetSizeClassForObjectSize(objectSize);
+    std::atomic<ObjectPool*>& poolForSizeClass = GetPoolsBySizeClass()[sizeClass];
+    ObjectPool* pool = poolForSizeClass.load(std::memory_order_acquire);
+    if (!pool) [[unlikely]] {
+        std::lock_guard lock(GetPoolsMutex());
+        pool = poolForSizeClass.load(std::memory_order_relaxed);
+        if (!pool) {
+            pool = GetPools().emplace_back(MakeUnique<ObjectPool>(sizeClass)).get();
+            poolForSizeClass.store(pool, std::memory_order_release);
+        }
     }
+    return pool;
+}
 
-    if (it == pools.end()) [[unlikely]] {
+ObjectBlock* ObjectPool::FindBlockContainingObject(const Object* object) {
+    if (!object) {
         return nullptr;
     }
 
-    return it->Allocate();
+    ObjectBlock* block = GetBlockForObject(object);
+    if (!BlockArena::Get().IsBlockStart(block) || !block->ContainsSlotFor(object)) {
+        return nullptr;
+    }
+    return block;
 }
 
-void ObjectPool::DestroyObject(Object* object) {
-    object->~Object();
-    Free(object);
+void* ObjectPool::AllocateObject(const u32 objectSize) {
+    ObjectPool* pool = GetPoolForObjectSize(objectSize);
+    if (!pool) [[unlikely]] {
+        return nullptr;
+    }
+
+    return pool->Allocate();
 }
 
-void ObjectPool::AllocateBlock() {
-    const i32 numberOfObjectsToAllocate = 128; // Todo - this should be configurable
-    const u64 blockElementSize = PoolElementSize + sizeof(ObjectHeader);
-    const u64 allocationSize = numberOfObjectsToAllocate * blockElementSize;
-    Array<u8> block(allocationSize);
-    for (i32 index = 0; index < numberOfObjectsToAllocate; index++) {
-        ObjectHeader* header = (ObjectHeader*)(block.data() + index * blockElementSize);
-        header->Generation = 0;
-        header->Flags = ObjectFlags::None;
-        header->Magic = ObjectHeader::RequiredMagic;
-        header->NextFree = index < (numberOfObjectsToAllocate - 1) ?
-            (ObjectHeader*)(block.data() + (index + 1) * blockElementSize) :
-            FreeListHeader;
+ObjectPool::BlockLayout ObjectPool::GetBlockLayout() const {
+    auto align = [](const u64 value, const u64 alignment) {
+        return (value + alignment - 1) & ~(alignment - 1);
+    };
+    auto layoutForSlotCount = [&](const u64 slotCount) {
+        BlockLayout layout;
+        layout.SlotCount = slotCount;
+        layout.BitmapWordCount = (slotCount + 63) / 64;
+        layout.FlagsOffset = sizeof(ObjectBlock);
+        layout.GenerationsOffset = align(layout.FlagsOffset + slotCount * sizeof(ObjectFlags), alignof(u16));
+        layout.PinCountsOffset = layout.GenerationsOffset + slotCount * sizeof(u16);
+        layout.InstanceLinksOffset = align(layout.PinCountsOffset + slotCount * sizeof(u16), alignof(Object*));
+        layout.MarkBitsOffset = align(layout.InstanceLinksOffset + slotCount * sizeof(Object*), alignof(u64));
+        layout.ScannedBitsOffset = layout.MarkBitsOffset + layout.BitmapWordCount * sizeof(u64);
+        layout.AllocatedBitsOffset = layout.ScannedBitsOffset + layout.BitmapWordCount * sizeof(u64);
+        layout.FirstSlotOffset = align(layout.AllocatedBitsOffset + layout.BitmapWordCount * sizeof(u64), SmallSizeClassGranularity);
+        layout.AllocationSize = align(layout.FirstSlotOffset + slotCount * PoolElementSize, BlockSize);
+        return layout;
+    };
+
+    // Every slot costs its object size, plus a byte of flags, two of generation, two of pin
+    // count, a pointer of instance link and three bits
+    u64 slotCount = std::max<u64>((BlockSize - sizeof(ObjectBlock)) / (PoolElementSize + sizeof(ObjectFlags) + 2 * sizeof(u16) + sizeof(Object*)), 1);
+    BlockLayout layout = layoutForSlotCount(slotCount);
+    while (slotCount > 1 && layout.AllocationSize > BlockSize) {
+        layout = layoutForSlotCount(--slotCount);
+    }
+    return layout;
+}
+
+bool ObjectPool::AllocateBlocks() {
+    const ObjectHeapSettings& settings = GetObjectHeapSettings();
+    const u32 initialBlocksPerGrowth = std::max(InitialBlocksPerGrowth ? InitialBlocksPerGrowth : settings.InitialBlocksPerGrowth, 1u);
+    const u32 maxBlocksPerGrowth = std::max(MaxBlocksPerGrowth ? MaxBlocksPerGrowth : settings.MaxBlocksPerGrowth, initialBlocksPerGrowth);
+    const u32 numberOfBlocks = std::max(BlocksPerGrowth, initialBlocksPerGrowth);
+
+    const BlockLayout layout = GetBlockLayout();
+
+    // Reuse blocks that have been given back to the arena first
+    u32 allocatedBlocks = 0;
+    while (allocatedBlocks < numberOfBlocks) {
+        u16 firstGeneration;
+        u8* memory = BlockArena::Get().AllocateReleased(layout.AllocationSize, firstGeneration);
+        if (!memory) {
+            break;
+        }
+        InitialiseBlock((ObjectBlock*) memory, layout, firstGeneration);
+        allocatedBlocks++;
+    }
+
+    // Memory from the arena is already zeroed by the OS, and only the block headers and
+    // bitmaps are written here, slots are initialised as they're handed out
+    // Near the end of the arena or the commit limit, the whole growth might not fit, so
+    // settle for fewer blocks before giving up
+    if (allocatedBlocks < numberOfBlocks) {
+        for (u32 remainingBlocks = numberOfBlocks - allocatedBlocks; remainingBlocks > 0; remainingBlocks /= 2) {
+            u8* memory = BlockArena::Get().Allocate(remainingBlocks * layout.AllocationSize, settings.UseHugePages);
+            if (memory) {
+                for (u32 blockIndex = 0; blockIndex < remainingBlocks; ++blockIndex) {
+                    InitialiseBlock((ObjectBlock*)(memory + blockIndex * layout.AllocationSize), layout, 0);
+                }
+                allocatedBlocks += remainingBlocks;
+                break;
+            }
+        }
+    }
+
+    if (allocatedBlocks == 0) {
+        return false;
+    }
+
+    // Don't keep asking for more than was available
+    BlocksPerGrowth = allocatedBlocks < numberOfBlocks ? allocatedBlocks : std::min(numberOfBlocks * 2, maxBlocksPerGrowth);
+    return true;
+}
+
+void ObjectPool::InitialiseBlock(ObjectBlock* block, const BlockLayout& layout, const u16 firstGeneration) {
+    u8* memory = (u8*) block;
+    block->Pool = this;
+    block->Slots = memory + layout.FirstSlotOffset;
+    block->Flags = (ObjectFlags*)(memory + layout.FlagsOffset);
+    block->Generations = (u16*)(memory + layout.GenerationsOffset);
+    block->PinCounts = (u16*)(memory + layout.PinCountsOffset);
+    block->InstanceLinks = (Object**)(memory + layout.InstanceLinksOffset);
+    block->MarkBits = (u64*)(memory + layout.MarkBitsOffset);
+    block->ScannedBits = (u64*)(memory + layout.ScannedBitsOffset);
+    block->AllocatedBits = (u64*)(memory + layout.AllocatedBitsOffset);
+    block->AllocationSize = layout.AllocationSize;
+    block->FirstGeneration = firstGeneration;
+    block->SlotCount = (u32) layout.SlotCount;
+    block->SlotStride = PoolElementSize;
+    block->BitmapWordCount = (u32) layout.BitmapWordCount;
+    block->InitialisedSlotCount = 0;
+    block->LiveCount = 0;
+    block->MarkedCount = 0;
+    block->MarkEpoch = ObjectBlock::CurrentMarkEpoch.load(std::memory_order_relaxed);
+    block->EmptySweepCount = 0;
+    block->FreeList = nullptr;
+    block->PreviousAvailable = nullptr;
+    block->NextAvailable = nullptr;
+    block->IsAvailable = false;
+    block->SweepPending = false;
+    // Released memory that's been reused isn't guaranteed to read back as zero everywhere
+    std::fill_n(block->PinCounts, layout.SlotCount, 0);
+    std::fill_n(block->MarkBits, layout.BitmapWordCount, 0);
+    std::fill_n(block->ScannedBits, layout.BitmapWordCount, 0);
+    std::fill_n(block->AllocatedBits, layout.BitmapWordCount, 0);
+
+    Blocks.emplace_back(block);
+    AddAvailableBlock(block, false);
+    BlockArena::Get().SetBlockStart(block, true);
+}
+
+void ObjectPool::ReleaseBlock(ObjectBlock* block) {
+    RemoveAvailableBlock(block);
+    BlockArena::Get().SetBlockStart(block, false);
+
+    // Generations are counted from FirstGeneration so this still works once they wrap
+    u16 generationsUsed = 0;
+    for (u32 slot = 0; slot < block->InitialisedSlotCount; ++slot) {
+        generationsUsed = std::max(generationsUsed, (u16)(block->GetGeneration(slot) - block->FirstGeneration));
+    }
+    BlockArena::Get().Release((u8*) block, block->AllocationSize, block->FirstGeneration + generationsUsed + 1);
+}
+
+void ObjectPool::AddAvailableBlock(ObjectBlock* block, const bool toFront) {
+    if (block->IsAvailable) {
+        return;
+    }
+
+    block->IsAvailable = true;
+    if (toFront) {
+        block->PreviousAvailable = nullptr;
+        block->NextAvailable = FirstAvailableBlock;
+        if (FirstAvailableBlock) {
+            FirstAvailableBlock->PreviousAvailable = block;
+        } else {
+            LastAvailableBlock = block;
+        }
+        FirstAvailableBlock = block;
+    } else {
+        block->NextAvailable = nullptr;
+        block->PreviousAvailable = LastAvailableBlock;
+        if (LastAvailableBlock) {
+            LastAvailableBlock->NextAvailable = block;
+        } else {
+            FirstAvailableBlock = block;
+        }
+        LastAvailableBlock = block;
+    }
+}
+
+void ObjectPool::RemoveAvailableBlock(ObjectBlock* block) {
+    if (!block->IsAvailable) {
+        return;
     }
 
-    FreeListHeader = (ObjectHeader*)block.data();
-    Blocks.emplace_back(Move(block));
+    if (block->PreviousAvailable) {
+        block->PreviousAvailable->NextAvailable = block->NextAvailable;
+    } else {
+        FirstAvailableBlock = block->NextAvailable;
+    }
+    if (block->NextAvailable) {
+        block->NextAvailable->PreviousAvailable = block->PreviousAvailable;
+    } else {
+        LastAvailableBlock = block->PreviousAvailable;
+    }
+    block->PreviousAvailable = nullptr;
+    block->NextAvailable = nullptr;
+    block->IsAvailable = false;
 }
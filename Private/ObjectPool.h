@@ -2,39 +2,349 @@
 
 #include "Object/Types.h"
 #include "Object/Object.h"
+#include "BlockArena.h"
 
-struct ObjectHeader {
-    ObjectHeader* NextFree;
-    u16 Generation;
-    u16 Magic;
-    ObjectFlags Flags;
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <mutex>
 
-    static constexpr u16 RequiredMagic = 0xc0fe;
+// Free slots are linked through their own memory, there's no object living in them
+struct FreeSlot {
+    FreeSlot* Next;
+};
+
+// Blocks are aligned to BlockSize, so the block owning an object can be found by masking
+// its address. Every object in a block starts within the first BlockSize bytes, blocks
+// for objects too large to fit are made larger but only ever hold one object.
+//
+// Object metadata lives in dense side tables after the block header rather than next to
+// each object, so the collector can mark and sweep without touching object memory:
+//   [ObjectBlock][Flags per slot][Generation per slot][Pin count per slot][Instance link per slot][Mark bits][Scanned bits][Allocated bits][Slots...]
+struct ObjectBlock {
+    ObjectPool* Pool;
+    u8* Slots;
+    ObjectFlags* Flags;
+    u16* Generations;
+    // How many threads have pinned each object, see ObjectPin
+    u16* PinCounts;
+    // The next object in its class's new instances, or nullptr once it's been taken off
+    // them, see Class::AddInstance
+    Object** InstanceLinks;
+    u64* MarkBits;
+    // Objects whose fields have been scanned, only used by concurrent marking
+    u64* ScannedBits;
+    u64* AllocatedBits;
+    u64 AllocationSize;
+    // Slots start at this generation when first handed out. It carries on from the last
+    // block to use the memory, so old handles never match the objects of a new block
+    u16 FirstGeneration;
+    u32 SlotCount;
+    u32 SlotStride;
+    u32 BitmapWordCount;
+    // Slots past this have never been handed out, so their memory hasn't been touched
+    u32 InitialisedSlotCount;
+    u32 LiveCount;
+    // Objects marked by the current collection. Blocks where every live object is marked
+    // have no garbage, so the sweep can skip them
+    u32 MarkedCount;
+    // The collection the mark and scanned bits belong to. Starting a collection only moves
+    // CurrentMarkEpoch on, the bits of a block are cleared when it's first marked in
+    // the new epoch, and read as clear until then
+    u32 MarkEpoch;
+    // How many sweeps in a row have found this block empty
+    u32 EmptySweepCount;
+    FreeSlot* FreeList;
+    // Links in the pool's list of blocks with free slots
+    ObjectBlock* PreviousAvailable;
+    ObjectBlock* NextAvailable;
+    bool IsAvailable;
+    // Holds destroyed objects which haven't been reclaimed yet, see ObjectSweepMode::Lazy
+    bool SweepPending;
+
+    Object* GetObject(u32 slot) const { return (Object*)(Slots + (u64) slot * SlotStride); }
+    u32 GetSlotIndex(const Object* object) const { return (u32)(((const u8*) object - Slots) / SlotStride); }
+    bool ContainsSlotFor(const Object* object) const;
+    bool HasFreeSlots() const { return FreeList || InitialisedSlotCount < SlotCount; }
+    bool HasUnmarkedObjects() const { return LiveCount != 0 && (!HasCurrentMarks() || MarkedCount != LiveCount); }
+
+    static inline std::atomic<u32> CurrentMarkEpoch = 0;
+    // Block epoch while its bits are being cleared, never used as an epoch itself
+    static constexpr u32 ClearingMarkEpoch = u32_max;
+
+    // Starts a new set of mark and scanned bits for every block
+    static void AdvanceMarkEpoch() {
+        u32 epoch = CurrentMarkEpoch.load(std::memory_order_relaxed) + 1;
+        if (epoch == ClearingMarkEpoch) {
+            epoch = 0;
+        }
+        CurrentMarkEpoch.store(epoch, std::memory_order_release);
+    }
+
+    bool HasCurrentMarks() const {
+        return std::atomic_ref<const u32>(MarkEpoch).load(std::memory_order_acquire) == CurrentMarkEpoch.load(std::memory_order_relaxed);
+    }
+    // Clears bits left over from an earlier epoch before they're first written in this one
+    void EnsureCurrentMarks() {
+        const u32 currentEpoch = CurrentMarkEpoch.load(std::memory_order_relaxed);
+        std::atomic_ref<u32> epoch(MarkEpoch);
+        u32 blockEpoch = epoch.load(std::memory_order_acquire);
+        while (blockEpoch != currentEpoch) [[unlikely]] {
+            if (blockEpoch != ClearingMarkEpoch && epoch.compare_exchange_weak(blockEpoch, ClearingMarkEpoch, std::memory_order_acquire)) {
+                std::fill_n(MarkBits, BitmapWordCount, 0);
+                std::fill_n(ScannedBits, BitmapWordCount, 0);
+                std::atomic_ref<u32>(MarkedCount).store(0, std::memory_order_relaxed);
+                epoch.store(currentEpoch, std::memory_order_release);
+                return;
+            }
+            // Another thread is clearing the bits
+            blockEpoch = epoch.load(std::memory_order_acquire);
+        }
+    }
+    // Mark bits of a word of slots, which are all clear if they're from an earlier epoch
+    u64 GetMarkWord(const u32 word) const {
+        return HasCurrentMarks() ? MarkBits[word] : 0;
+    }
+
+    bool IsMarked(const u32 slot) const {
+        return HasCurrentMarks() && (std::atomic_ref<u64>(MarkBits[slot / 64]).load(std::memory_order_relaxed) & (u64(1) << (slot % 64))) != 0;
+    }
+    // Returns false if the slot was already marked
+    bool Mark(const u32 slot) {
+        EnsureCurrentMarks();
+        const u64 bit = u64(1) << (slot % 64);
+        if (std::atomic_ref<u64>(MarkBits[slot / 64]).fetch_or(bit, std::memory_order_relaxed) & bit) {
+            return false;
+        }
+        std::atomic_ref<u32>(MarkedCount).fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    bool IsScanned(const u32 slot) const {
+        return HasCurrentMarks() && (std::atomic_ref<u64>(ScannedBits[slot / 64]).load(std::memory_order_acquire) & (u64(1) << (slot % 64))) != 0;
+    }
+    // Returns false if the slot was already scanned
+    bool SetScanned(const u32 slot) {
+        EnsureCurrentMarks();
+        const u64 bit = u64(1) << (slot % 64);
+        return (std::atomic_ref<u64>(ScannedBits[slot / 64]).fetch_or(bit, std::memory_order_acq_rel) & bit) == 0;
+    }
+
+    // Generations are read by threads pinning objects, while the collector reclaims slots
+    u16 GetGeneration(const u32 slot) const { return std::atomic_ref<u16>(Generations[slot]).load(std::memory_order_relaxed); }
+    void NextGeneration(const u32 slot) { std::atomic_ref<u16>(Generations[slot]).fetch_add(1, std::memory_order_relaxed); }
+
+    // Set once an object starts being destroyed, after which it can't be pinned again
+    static constexpr u16 PinDyingBit = u16(1) << 15;
+    bool TryPin(const u32 slot, const u16 generation) {
+        std::atomic_ref<u16> pinCount(PinCounts[slot]);
+        u16 count = pinCount.load(std::memory_order_relaxed);
+        do {
+            if ((count & PinDyingBit) || count + 1 == PinDyingBit) {
+                return false;
+            }
+        } while (!pinCount.compare_exchange_weak(count, count + 1, std::memory_order_acquire, std::memory_order_relaxed));
+
+        // The slot may have been reclaimed and reused before the pin was taken
+        if (GetGeneration(slot) != generation) {
+            Unpin(slot);
+            return false;
+        }
+        return true;
+    }
+    void Unpin(const u32 slot) { std::atomic_ref<u16>(PinCounts[slot]).fetch_sub(1, std::memory_order_release); }
+    // Returns false if the object is pinned, in which case it must be kept for now
+    bool TrySetDying(const u32 slot) {
+        u16 count = 0;
+        return std::atomic_ref<u16>(PinCounts[slot]).compare_exchange_strong(count, PinDyingBit, std::memory_order_acquire, std::memory_order_relaxed)
+            || count == PinDyingBit;
+    }
+    // Stops new pins without waiting for existing ones, which keep the memory until they're released
+    void SetDying(const u32 slot) { std::atomic_ref<u16>(PinCounts[slot]).fetch_or(PinDyingBit, std::memory_order_relaxed); }
+    // For objects set dying by the collector which turn out to be reachable after all
+    void ClearDying(const u32 slot) { std::atomic_ref<u16>(PinCounts[slot]).fetch_and(u16(~PinDyingBit), std::memory_order_relaxed); }
+    bool IsPinned(const u32 slot) const { return (std::atomic_ref<u16>(PinCounts[slot]).load(std::memory_order_acquire) & ~PinDyingBit) != 0; }
+    // Slots are unpinned and pinnable again once their generation has moved on
+    void ResetPins(const u32 slot) { std::atomic_ref<u16>(PinCounts[slot]).store(0, std::memory_order_release); }
+
+    bool IsAllocated(const u32 slot) const {
+        return (std::atomic_ref<u64>(AllocatedBits[slot / 64]).load(std::memory_order_relaxed) & (u64(1) << (slot % 64))) != 0;
+    }
+    // Other threads may be allocating from the same block through their caches
+    void SetAllocated(const u32 slot, const bool isAllocated) {
+        const u64 bit = u64(1) << (slot % 64);
+        if (isAllocated) {
+            std::atomic_ref<u64>(AllocatedBits[slot / 64]).fetch_or(bit, std::memory_order_relaxed);
+        } else {
+            std::atomic_ref<u64>(AllocatedBits[slot / 64]).fetch_and(~bit, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Counts a step of work spread over several calls, returning whether the deadline has passed.
+// Checking the time isn't free, so it's only done every so many steps
+inline bool IsPastDeadline(u32& steps, const std::chrono::steady_clock::time_point deadline) {
+    constexpr u32 stepsBetweenDeadlineChecks = 64;
+    return ++steps % stepsBetweenDeadlineChecks == 0 && std::chrono::steady_clock::now() >= deadline;
+}
+
+// How far ObjectPool::ReleaseEmptyBlocks has got through a pool, so the work can be spread
+// over several calls
+struct EmptyBlockRelease {
+    usize BlockIndex = 0;
+    u32 EmptyBlockCount = 0;
+    u32 BlocksToRelease = 0;
+    bool IsReleasing = false;
 };
-static_assert(sizeof(ObjectHeader) == 16, "Object header should be 16 bytes");
 
 struct ObjectPool {
-    ObjectPool(const u32 poolElementSize);
+    ObjectPool(u32 sizeClass);
 
     u32 PoolElementSize;
+    u32 SizeClass;
 
+    // Allocates from a cache local to the calling thread, which is refilled from the
+    // pool in batches, so threads only contend on the pool once per batch
     void* Allocate();
-    void Free(Object* object);
-    bool ContainsObject(Object* object) const;
-    Array<Array<u8>>& GetBlocks() { return Blocks; }
+    // Takes up to count free slots from the pool
+    u32 AllocateBatch(FreeSlot*& slots, u32 count);
+    void FreeBatch(FreeSlot* slots);
+    u32 GetThreadCacheBatchSize() const;
+    // Reclaims the slots of the block's unmarked objects which have finished being destroyed.
+    // Other blocks of the pool can be swept at the same time
+    void SweepBlock(ObjectBlock* block);
+    // Leaves the block to be swept when the allocator next takes slots from it
+    void DeferSweep(ObjectBlock* block);
+    // Sweeps blocks still waiting on a deferred sweep, must be done before their marks are cleared.
+    // Returns false if it stopped at the deadline with blocks left to sweep
+    bool FinishDeferredSweeps(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+    // Decommits blocks that have stayed empty, should be called after sweeping the pool.
+    // Returns false if it stopped at the deadline, call again with the same progress to carry on
+    bool ReleaseEmptyBlocks(EmptyBlockRelease& progress, std::chrono::steady_clock::time_point deadline);
+    void ReleaseEmptyBlocks() {
+        EmptyBlockRelease progress;
+        ReleaseEmptyBlocks(progress, std::chrono::steady_clock::time_point::max());
+    }
+    Array<ObjectBlock*>& GetBlocks() { return Blocks; }
+
+    static constexpr u64 BlockSize = BlockArena::UnitSize;
+    static constexpr u32 ThreadCacheBatchBytes = 16 * 1024;
+    static constexpr u32 MaxThreadCacheBatchSize = 64;
+
+    // Zero uses the global heap settings
+    void SetBlocksPerGrowth(u32 initialBlocksPerGrowth, u32 maxBlocksPerGrowth);
+
+    // Sizes up to 128 bytes are split into 16 byte classes, and every power of two
+    // above that is split into 4 classes, so no more than 25% of a slot is wasted
+    static constexpr u32 SmallSizeClassGranularity = 16;
+    static constexpr u32 SmallSizeClassLimit = 128;
+    static constexpr u32 SizeClassesPerPowerOfTwo = 4;
+    static constexpr u32 MaxPooledObjectSize = 1u << 31;
+    static constexpr u32 NumberOfSizeClasses = 104;
 
+    static u32 GetSizeClassForObjectSize(u32 objectSize);
+    static constexpr u32 GetPoolSizeForSizeClass(const u32 sizeClass) {
+        constexpr u32 smallSizeClasses = SmallSizeClassLimit / SmallSizeClassGranularity;
+        if (sizeClass < smallSizeClasses) {
+            return (sizeClass + 1) * SmallSizeClassGranularity;
+        }
+
+        const u32 largeSizeClass = sizeClass - smallSizeClasses;
+        const u32 powerOfTwo = std::bit_width(SmallSizeClassLimit) - 1 + largeSizeClass / SizeClassesPerPowerOfTwo;
+        const u32 step = largeSizeClass % SizeClassesPerPowerOfTwo + 1;
+        return (1u << powerOfTwo) + step * ((1u << powerOfTwo) / SizeClassesPerPowerOfTwo);
+    }
     static u32 GetPoolSizeForObjectSize(u32 objectSize);
-    static ObjectPool* FindObjectPoolContainingObject(Object* object);
+    static ObjectPool* GetPoolForObjectSize(u32 objectSize);
+    static ObjectBlock* FindBlockContainingObject(const Object* object);
     static void* AllocateObject(u32 objectSize);
-    void DestroyObject(Object* object);
+    // Gives the calling thread's cached slots back to their pools
+    static void FlushThreadCache();
+    // While a collection is spread over several calls, objects allocated part way through
+    // are marked so they survive it
+    static void SetAllocateMarked(bool allocateMarked) { AllocateMarked.store(allocateMarked, std::memory_order_relaxed); }
 
-    static Array<ObjectPool>& GetPools();
+    // Pools are only ever added, hold GetPoolsMutex while iterating if other threads may be allocating
+    static Array<UniquePtr<ObjectPool>>& GetPools();
+    static std::mutex& GetPoolsMutex();
+    std::mutex& GetMutex() { return Mutex; }
 
 private:
-    Array<Array<u8>> Blocks;
-    ObjectHeader* FreeListHeader = nullptr;
+    // Guards everything below, shared with other threads allocating from the same size class
+    std::mutex Mutex;
+    Array<ObjectBlock*> Blocks;
+    // Blocks with free slots. Blocks which become empty go to the back, so allocation
+    // fills up the busiest blocks first and leaves the empty ones free to be released
+    ObjectBlock* FirstAvailableBlock = nullptr;
+    ObjectBlock* LastAvailableBlock = nullptr;
+    Array<ObjectBlock*> DeferredSweepBlocks;
+    u32 BlocksPerGrowth = 0;
+    u32 InitialBlocksPerGrowth = 0;
+    u32 MaxBlocksPerGrowth = 0;
+
+    static inline std::atomic<bool> AllocateMarked = false;
+
+    static std::array<std::atomic<ObjectPool*>, NumberOfSizeClasses>& GetPoolsBySizeClass();
 
-    void AllocateBlock();
+    struct BlockLayout {
+        u64 FlagsOffset;
+        u64 GenerationsOffset;
+        u64 PinCountsOffset;
+        u64 InstanceLinksOffset;
+        u64 MarkBitsOffset;
+        u64 ScannedBitsOffset;
+        u64 AllocatedBitsOffset;
+        u64 FirstSlotOffset;
+        u64 SlotCount;
+        u64 BitmapWordCount;
+        u64 AllocationSize;
+    };
+    BlockLayout GetBlockLayout() const;
+    bool AllocateBlocks();
+    void InitialiseBlock(ObjectBlock* block, const BlockLayout& layout, u16 firstGeneration);
+    void ReleaseBlock(ObjectBlock* block);
+    // Must be done before an object's slot can be reused
+    static void TakeOffNewInstances(Object* object);
+    // Destructs the objects and returns their slots as a list, doesn't touch the pool
+    static FreeSlot* ReclaimDestroyedObjects(ObjectBlock* block, FreeSlot*& lastSlot, u32& slotCount);
+    void AddFreeSlots(ObjectBlock* block, FreeSlot* firstSlot, FreeSlot* lastSlot, u32 slotCount);
+    void SweepDeferredBlock(ObjectBlock* block);
+    void AddAvailableBlock(ObjectBlock* block, bool toFront);
+    void RemoveAvailableBlock(ObjectBlock* block);
 };
 
-ObjectHeader* GetHeaderForObject(const Object* object);
+// Only valid for objects known to be allocated from a pool, use
+// ObjectPool::FindBlockContainingObject for arbitrary pointers
+inline ObjectBlock* GetBlockForObject(const Object* object) {
+    return (ObjectBlock*)((uintptr_t) object & ~(ObjectPool::BlockSize - 1));
+}
+
+// A view of one object's entries in its block's side tables
+struct ObjectMetadata {
+    ObjectBlock* Block = nullptr;
+    u32 Slot = 0;
+
+    explicit operator bool() const { return Block != nullptr; }
+
+    ObjectFlags& Flags() const { return Block->Flags[Slot]; }
+    u16 Generation() const { return Block->GetGeneration(Slot); }
+    bool IsMarked() const { return Block->IsMarked(Slot); }
+    bool Mark() const { return Block->Mark(Slot); }
+    bool IsScanned() const { return Block->IsScanned(Slot); }
+    bool SetScanned() const { return Block->SetScanned(Slot); }
+};
+
+// Only valid for objects known to be allocated from a pool
+inline ObjectMetadata GetMetadataForPoolObject(const Object* object) {
+    ObjectBlock* block = GetBlockForObject(object);
+    return { block, block->GetSlotIndex(object) };
+}
+
+// Returns an empty view if the pointer isn't to an object allocated from a pool
+ObjectMetadata GetMetadataForObject(const Object* object);
+// Returns an empty view if the handle's object has been reclaimed, destroyed objects are
+// still found until then
+ObjectMetadata GetMetadataForHandle(ObjectHandle handle);
+// The handle of the object in the slot, whether or not it's still live
+ObjectHandle GetHandleForMetadata(ObjectMetadata metadata);
@@ -1,2 +1,10 @@
 #pragma once
 
+// Process-wide state that is never destroyed. Objects and names may still be used by other
+// static destructors at exit, and collection worker threads are left waiting rather than
+// joined, so none of it can go away before the process does
+template<typename T>
+T& GetNeverDestroyed() {
+    static T* instance = new T();
+    return *instance;
+}
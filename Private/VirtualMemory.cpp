@@ -0,0 +1,71 @@
+#include "VirtualMemory.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+
+u64 GetVirtualMemoryPageSize() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+}
+
+void* ReserveVirtualMemory(const u64 size) {
+    return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+void ReleaseVirtualMemory(void* address, const u64 size) {
+    VirtualFree(address, 0, MEM_RELEASE);
+}
+
+bool CommitVirtualMemory(void* address, const u64 size) {
+    return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+}
+
+void DecommitVirtualMemory(void* address, const u64 size) {
+    VirtualFree(address, size, MEM_DECOMMIT);
+}
+
+void AdviseHugePages(void* address, const u64 size) {
+    // Large pages need special privileges on Windows, so there is nothing to hint here
+}
+
+#else
+
+u64 GetVirtualMemoryPageSize() {
+    return (u64) sysconf(_SC_PAGESIZE);
+}
+
+void* ReserveVirtualMemory(const u64 size) {
+    void* address = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return address == MAP_FAILED ? nullptr : address;
+}
+
+void ReleaseVirtualMemory(void* address, const u64 size) {
+    munmap(address, size);
+}
+
+bool CommitVirtualMemory(void* address, const u64 size) {
+    return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void DecommitVirtualMemory(void* address, const u64 size) {
+    // Leave the pages accessible so the mapping isn't split up, the kernel will hand
+    // back zeroed pages if they are touched again
+    madvise(address, size, MADV_DONTNEED);
+}
+
+void AdviseHugePages(void* address, const u64 size) {
+#if defined(MADV_HUGEPAGE)
+    madvise(address, size, MADV_HUGEPAGE);
+#endif
+}
+
+#endif
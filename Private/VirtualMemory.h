@@ -0,0 +1,14 @@
+#pragma once
+
+#include "Object/Types.h"
+
+// Thin wrappers over the OS virtual memory APIs. Reserved memory has no backing until
+// it is committed, and decommitted memory reads back as zero once committed again
+u64 GetVirtualMemoryPageSize();
+void* ReserveVirtualMemory(u64 size);
+void ReleaseVirtualMemory(void* address, u64 size);
+bool CommitVirtualMemory(void* address, u64 size);
+void DecommitVirtualMemory(void* address, u64 size);
+void AdviseHugePages(void* address, u64 size);
+
+static constexpr u64 HugePageSize = 2 * 1024 * 1024;
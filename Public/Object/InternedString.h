@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Object/Types.h"
+
+#include <functional>
+#include <string_view>
+
+// A string stored once in a global table and referred to by its index, so copying,
+// comparing and hashing one is just as quick as it is for a u32. Strings are never removed
+// from the table, so only intern names, not arbitrary text. Interning is explicit so that
+// lookups don't add to the table by accident, use Find to look a string up
+struct InternedString {
+    InternedString() = default;
+    explicit InternedString(std::string_view string);
+    explicit InternedString(const String& string) : InternedString(std::string_view(string)) {}
+    explicit InternedString(const char* string) : InternedString(std::string_view(string)) {}
+
+    // Returns an empty string if the string hasn't been interned, without adding it
+    static InternedString Find(std::string_view string);
+
+    u32 GetId() const { return id; }
+    bool IsEmpty() const { return id == 0; }
+    const String& ToString() const;
+    operator const String&() const { return ToString(); }
+
+    bool operator==(const InternedString& other) const { return id == other.id; }
+    bool operator==(std::string_view other) const { return ToString() == other; }
+    bool operator==(const String& other) const { return ToString() == other; }
+    bool operator==(const char* other) const { return ToString() == other; }
+
+private:
+    u32 id = 0;
+};
+
+template<>
+struct std::hash<InternedString> {
+    usize operator()(const InternedString& string) const { return std::hash<u32>{}(string.GetId()); }
+};
@@ -4,17 +4,26 @@
 #include "Object/TypeTraits.h"
 #include "Object/ObjectField.h"
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <span>
+#include <string_view>
+
 enum class ObjectFlags : u8 {
     None = 0,
     Allocated = 1 << 0,
-    Unreachable = 1 << 1,
+    Unreachable = 1 << 1, // No longer stored, reachability is tracked in the pool mark bitmaps
     InRootSet = 1 << 2,
     IsBeingDestroyed = 1 << 3,
     IsDestroyed = 1 << 4,
+    InRememberedSet = 1 << 5,
 };
 DEFINE_ENUM_CLASS_FLAGS(ObjectFlags)
 
 struct Class;
+struct ObjectPool;
 
 namespace Detail {
     template<typename T>
@@ -23,6 +32,10 @@ namespace Detail {
     template<typename T>
     requires(IsEnumType<T>)
     void ConfigureEnum(Enum*);
+
+    // Set while the collector needs to hear about changes to object references
+    extern std::atomic<bool> WriteBarrierEnabled;
+    void WriteBarrierSlow(Object* object, Object* oldReference, Object* newReference);
 }
 
 template<typename T>
@@ -35,6 +48,7 @@ struct Object {
 
     const Array<UniquePtr<ObjectField>>& GetObjectFields() const;
 
+    // Roots aren't counted, adding an object that's already a root does nothing
     void AddToRootSet();
     void RemoveFromRootSet();
 
@@ -47,7 +61,34 @@ struct Object {
 
     u32 GetGeneration() const;
 
+    // Changes to reflected Object* and Array<Object*> fields must go through the write
+    // barrier, before the change is made, or an incremental or concurrent collection may
+    // free objects that are still referenced. SetObjectReference does this for single
+    // references, for arrays call WriteBarrier with each reference added or removed
+    void WriteBarrier(Object* oldReference, Object* newReference) {
+        if (Detail::WriteBarrierEnabled.load(std::memory_order_relaxed)) [[unlikely]] {
+            Detail::WriteBarrierSlow(this, oldReference, newReference);
+        }
+    }
+    template<typename T, typename U>
+    void SetObjectReference(T*& field, U* value) {
+        WriteBarrier(field, value);
+        field = value;
+    }
+
     static void CollectGarbage();
+    // Only collects objects allocated since the last collection, which is much quicker when
+    // most objects are long lived. The first call does a full collection, after which every
+    // change to a reflected reference field must go through the write barrier
+    static void CollectYoungGarbage();
+    // Does as much of a collection as fits in the budget, picking up where the last call
+    // left off. Returns true once the collection has completed
+    static bool CollectGarbageIncremental(std::chrono::microseconds budget);
+    // Marks on a background thread while the caller carries on. The first call starts
+    // marking, and later calls return false until it's done, when a short pause
+    // destroys and sweeps the garbage and true is returned. References to destroyed
+    // objects are nulled in that pause, the background thread never writes to objects
+    static bool CollectGarbageConcurrent();
 
     Class* GetClass() const { return classInstance; }
 
@@ -88,6 +129,22 @@ Class* NewObject<Class>();
 
 bool IsValid(const Object* object);
 
+// A compact reference to an object, made up of where the object lives and its generation.
+// It stays the same for the object's lifetime and never resolves to a different object
+// once it's gone, so it can be used as an ID anywhere in the process. Handles aren't
+// meaningful to other processes
+struct ObjectHandle {
+    u64 Value = 0;
+
+    explicit operator bool() const { return Value != 0; }
+    bool operator==(const ObjectHandle&) const = default;
+};
+
+// Returns an empty handle for invalid objects
+ObjectHandle GetObjectHandle(const Object* object);
+// Returns nullptr if the object has been destroyed
+Object* ResolveObjectHandle(ObjectHandle handle);
+
 template<typename T>
 struct Class* StaticClass();
 
@@ -97,39 +154,118 @@ template<typename T> const T* Cast(const Object* object);
 
 struct Class : Object {
     u32 Size() const { return size; }
-    const String& Name() const { return name; }
+    const InternedString& Name() const { return name; }
     Class* Parent() const { return parent; }
-    const Array<UniquePtr<ObjectField>>& Fields() const { return fields; }
+    // Fields are only described the first time they're needed, so registering a class at
+    // startup is cheap. That's at the latest when its first object is created
+    const Array<UniquePtr<ObjectField>>& Fields() const { EnsureFieldsRegistered(); return fields; }
+    // Fields carrying the tag, inherited ones included
+    const Array<ObjectField*>& GetFieldsWithTag(InternedString tag) const;
+    const Array<ObjectField*>& GetFieldsWithTag(std::string_view tag) const;
+    // Every field, inherited ones included, packed together in the same order as Fields
+    const Array<ClassField>& FieldTable() const { EnsureFieldsRegistered(); return fieldTable; }
+    std::span<const std::pair<InternedString, String>> GetFieldTags(const ClassField& field) const {
+        return { field.Tags, field.TagCount };
+    }
+
+    // Offsets of the Object* and Array<Object*> fields, inherited ones included, so the
+    // collector can follow references without going through the field descriptions.
+    // Always ready for classes which have objects
+    const Array<u32>& ObjectReferenceOffsets() const { return objectReferenceOffsets; }
+    const Array<u32>& ObjectArrayReferenceOffsets() const { return objectArrayReferenceOffsets; }
+    bool HasObjectReferences() const { return !objectReferenceOffsets.empty() || !objectArrayReferenceOffsets.empty(); }
 
     template<typename T>
-    bool IsDerivedFrom() {
+    bool IsDerivedFrom() const {
         return IsDerivedFrom(StaticClass<T>());
     }
 
+    // Copies, in the order the classes registered. Classes registered on demand can be added
+    // from any thread, so these can't hand out the arrays themselves
     Array<Class*> GetDerivedClasses() const;
+    Array<Class*> GetChildClasses() const;
+    // Returns nullptr if no class with the name has been registered. Names that have never
+    // been interned can't be class names, so they aren't interned by looking them up
+    static Class* FindClass(std::string_view name);
+
+    // Every class keeps its ancestors by depth, so this doesn't need to walk the hierarchy
+    bool IsDerivedFrom(const Class* parentClass) const {
+        return parentClass && parentClass->depth <= depth && ancestors[parentClass->depth] == parentClass;
+    }
+    // How many classes this derives from, Object is at depth 0
+    u32 Depth() const { return depth; }
 
-    bool IsDerivedFrom(const Class* parentClass) const;
-
-    Object* StaticInstance() const { return staticInstance; }
+    Object* StaticInstance() const { EnsureFieldsRegistered(); return staticInstance; }
     template<typename T>
-    T* StaticInstance() const { return Cast<T>(staticInstance); }
+    T* StaticInstance() const { return Cast<T>(StaticInstance()); }
+
+    void EnsureFieldsRegistered() const {
+        if (!areFieldsRegistered.load(std::memory_order_acquire)) [[unlikely]] {
+            const_cast<Class*>(this)->RegisterFields();
+        }
+    }
 
 private:
     Class* parent = nullptr;
     Object* staticInstance = nullptr;
-    String name;
+    InternedString name;
     u32 size;
     Array<UniquePtr<ObjectField>> fields;
+    Map<InternedString, Array<ObjectField*>> fieldsByTag;
+    Array<ClassField> fieldTable;
+    Array<u32> objectReferenceOffsets;
+    Array<u32> objectArrayReferenceOffsets;
+    // Object first, ending with this class
+    Array<Class*> ancestors;
+    Array<Class*> childClasses;
+    Array<Class*> derivedClasses;
+    u32 depth = 0;
     void(*constructor)(Object* object);
+    // Describes the fields and sets up the static instance, see EnsureFieldsRegistered
+    void(*describeFields)(Class* classInstance);
+    std::once_flag fieldsRegisteredFlag;
+    std::atomic<bool> areFieldsRegistered = false;
+    // Cached when the class is registered, so allocation doesn't have to look up the size class
+    ObjectPool* pool = nullptr;
+    // Objects of exactly this class, see ObjectRangeBase. They're kept as handles, so ones
+    // which have since been reclaimed are skipped rather than removed straight away
+    Array<ObjectHandle> instances;
+    // Objects created since they were last moved onto instances, linked through their blocks
+    // and ending with this class, so NewObject never has to lock. See AddInstance
+    std::atomic<Object*> newInstances{ this };
+    // Guards instances and the counts below, never held while a range's caller runs
+    std::mutex instancesMutex;
+    // Instances can't be compacted while ranges are part way through them
+    u32 iteratingRangeCount = 0;
+    usize compactedInstanceCount = 0;
 
     template<typename T>
     friend void Detail::ConfigureClass(Class*);
     friend Object* NewObject(Class*);
+    friend struct Object;
+    friend struct ObjectPool;
+    friend struct ObjectRangeBase;
 
     void Construct(Object*);
     void Register();
+    void RegisterFields();
+    void AddInstance(Object* object);
+    // Moves new objects onto instances, in the order they were created, and drops reclaimed
+    // ones once instances has doubled since it was last compacted. Hold instancesMutex
+    void TakeNewInstances();
 };
 
+namespace Detail {
+    // Enumerator names are looked up ignoring ASCII case, without lowering a copy of the key
+    struct CaseInsensitiveHash {
+        usize operator()(std::string_view string) const;
+    };
+
+    struct CaseInsensitiveEqual {
+        bool operator()(std::string_view a, std::string_view b) const;
+    };
+}
+
 struct Enum : Object {
     const String& Name() const { return name; }
     const Array<i32>& Values() const { return values; }
@@ -137,7 +273,17 @@ struct Enum : Object {
     bool IsEnumFlags() const { return isEnumFlags; }
 
     const String& ToString(i32 value) const;
-    i32 FromString(const String& value) const;
+    i32 FromString(std::string_view value) const;
+    i32 FromString(const String& value) const { return FromString(std::string_view(value)); }
+    i32 FromString(const char* value) const { return FromString(std::string_view(value)); }
+
+    // Writes a flags value as its enumerators joined by '|', e.g. "First|Second". Returns
+    // an empty string for 0 unless there's an enumerator for it, and the unknown enumerator
+    // string if some bits aren't covered by any enumerator
+    String FlagsToString(i32 value) const;
+    // Reads '|' separated enumerators, ignoring case and surrounding spaces. Returns -1 if
+    // any of them aren't enumerators of this enum
+    i32 FlagsFromString(std::string_view value) const;
 
 private:
     String name;
@@ -145,9 +291,15 @@ private:
     Array<String> enumerators;
     bool isEnumFlags;
 
+    // Built once the enumerators are known, the names are views of the enumerators array
+    Map<i32, u32> indicesByValue;
+    std::unordered_map<std::string_view, i32, Detail::CaseInsensitiveHash, Detail::CaseInsensitiveEqual> valuesByName;
+
     template<typename T>
     requires(IsEnumType<T>)
     friend void Detail::ConfigureEnum(Enum*);
+
+    void BuildLookups();
 };
 
 namespace Detail {
@@ -177,20 +329,28 @@ namespace Detail {
 DECLARE_OBJECT(Class)
 DECLARE_OBJECT(Enum);
 
-#define IMPL_OBJECT(type, parentType) \
+// Like IMPL_OBJECT, but the class is only registered the first time StaticClass is called
+// for it, rather than at startup. Until then Class::FindClass won't find it, and it won't be
+// in its parent's derived classes
+#define IMPL_OBJECT_ON_DEMAND(type, parentType) \
     namespace Detail { \
         template<> \
         void ConfigureClass<type>(Class* classInstance) { \
-            classInstance->name = #type; \
+            classInstance->name = InternedString(#type); \
             classInstance->parent = StaticClass<parentType>(); \
             classInstance->size = sizeof(type); \
             classInstance->constructor = [](Object* object) { new (object) type{}; }; \
-            StaticInstance<type>()->GetObjectFields(classInstance->fields); \
-            StaticInstance<type>()->classInstance = classInstance; \
-            classInstance->staticInstance = StaticInstance<type>(); \
+            classInstance->describeFields = [](Class* classInstance) { \
+                StaticInstance<type>()->GetObjectFields(classInstance->fields); \
+                StaticInstance<type>()->classInstance = classInstance; \
+                classInstance->staticInstance = StaticInstance<type>(); \
+            }; \
             classInstance->Register(); \
         } \
-    } \
+    }
+
+#define IMPL_OBJECT(type, parentType) \
+    IMPL_OBJECT_ON_DEMAND(type, parentType) \
     static bool configuredObjectClassInstance_##type = []{ \
         StaticClass<type>(); \
         return true; \
@@ -215,6 +375,7 @@ DECLARE_OBJECT(Enum);
                 enumInstance->values.push_back(static_cast<i32>(entry.first)); \
                 enumInstance->enumerators.emplace_back(entry.second); \
             } \
+            enumInstance->BuildLookups(); \
         } \
     } \
     static bool configuredEnumClassInstance_##type = [] { \
@@ -259,9 +420,52 @@ struct WeakObjectPtrBase {
     const Object* operator->() const { return Get(); }
     Object* operator->() { return Get(); }
 
+    ObjectHandle GetHandle() const { return handle; }
+
+private:
+    ObjectHandle handle;
+};
+
+// Keeps an object from being collected or having its memory reused for as long as the pin
+// is held, and can be taken on any thread while another is collecting garbage. Objects it
+// references are kept along with it. The pinned object may still be destroyed explicitly
+struct ObjectPinBase {
+    ObjectPinBase() = default;
+    // Empty if the object is gone or is being destroyed
+    explicit ObjectPinBase(ObjectHandle handle);
+    ObjectPinBase(const ObjectPinBase&) = delete;
+    ObjectPinBase(ObjectPinBase&& other) noexcept;
+    ObjectPinBase& operator=(const ObjectPinBase&) = delete;
+    ObjectPinBase& operator=(ObjectPinBase&& other) noexcept;
+    ~ObjectPinBase();
+
+    bool IsValid() const { return object != nullptr; }
+    operator bool() const { return IsValid(); }
+
+    const Object* Get() const { return object; }
+    Object* Get() { return object; }
+    const Object* operator->() const { return Get(); }
+    Object* operator->() { return Get(); }
+
+    void Unpin();
+
 private:
     Object* object = nullptr;
-    u16 generation = 0;
+};
+
+template<typename T>
+struct ObjectPin : ObjectPinBase {
+    static_assert(Detail::IsObjectType<T>, "Can only pin objects");
+
+    ObjectPin() = default;
+    explicit ObjectPin(ObjectHandle handle)
+        : ObjectPinBase(handle)
+    {}
+
+    const T* Get() const { return (const T*) ObjectPinBase::Get(); }
+    T* Get() { return (T*) ObjectPinBase::Get(); }
+    const T* operator->() const { return (const T*) ObjectPinBase::operator->(); }
+    T* operator->() { return (T*) ObjectPinBase::operator->(); }
 };
 
 template<typename T>
@@ -276,6 +480,9 @@ struct WeakObjectPtr : WeakObjectPtrBase {
     T* Get() { return (T*) WeakObjectPtrBase::Get(); }
     const T* operator->() const { return (const T*) WeakObjectPtrBase::operator->(); }
     T* operator->() { return (T*) WeakObjectPtrBase::operator->(); }
+
+    // Safe to use from any thread, unlike Get
+    ObjectPin<T> Pin() const { return ObjectPin<T>(GetHandle()); }
 };
 
 // Strong object pointers prevent the pointed to object being garbage collected,
@@ -284,6 +491,11 @@ struct WeakObjectPtr : WeakObjectPtrBase {
 // use with care. You probably don't want these to hang around for too long
 struct StrongObjectPtrBase {
     StrongObjectPtrBase(Object* object);
+    // Copies hold the object separately, moving hands over the original's hold on it
+    StrongObjectPtrBase(const StrongObjectPtrBase& other);
+    StrongObjectPtrBase(StrongObjectPtrBase&& other) noexcept;
+    StrongObjectPtrBase& operator=(const StrongObjectPtrBase& other);
+    StrongObjectPtrBase& operator=(StrongObjectPtrBase&& other) noexcept;
     virtual ~StrongObjectPtrBase();
 
     bool IsValid() const;
@@ -313,11 +525,94 @@ struct StrongObjectPtr : StrongObjectPtrBase {
     T* operator->() { return (T*) StrongObjectPtrBase::operator->(); }
 };
 
+// Iterates over the live objects of a class, and of the classes derived from it if asked.
+// Each class keeps its objects together in a dense array, which is copied out a batch at a
+// time, so no lock is held while the caller runs and other threads can carry on creating and
+// destroying objects. Objects and classes created while iterating aren't visited, and objects
+// destroyed before they're reached are skipped
+struct ObjectRangeBase {
+    ObjectRangeBase(Class* objectClass, bool includeDerived);
+    ObjectRangeBase(const ObjectRangeBase&) = delete;
+    ObjectRangeBase& operator=(const ObjectRangeBase&) = delete;
+    ~ObjectRangeBase();
+
+    struct End {};
+    struct Iterator {
+        ObjectRangeBase* Range;
+
+        Object* operator*() const { return Range->current; }
+        Iterator& operator++() { Range->Next(); return *this; }
+        bool operator==(End) const { return Range->current == nullptr; }
+    };
+    Iterator begin() { return { this }; }
+    End end() const { return {}; }
+
+private:
+    static constexpr u32 BatchSize = 64;
+
+    // The class, followed by its derived classes if they're included
+    Array<Class*> classes;
+    Class* visitingClass = nullptr;
+    Object* current = nullptr;
+    u32 classIndex = 0;
+    u32 instanceIndex = 0;
+    u32 instanceCount = 0;
+    std::array<ObjectHandle, BatchSize> batch;
+    u32 batchIndex = 0;
+    u32 batchCount = 0;
+
+    void Next();
+    bool NextBatch();
+    void EnterClass(Class* nextClass);
+    void LeaveClass();
+};
+
+template<typename T>
+struct ObjectRange : ObjectRangeBase {
+    static_assert(Detail::IsObjectType<T>, "Can only iterate over objects");
+
+    explicit ObjectRange(const bool includeDerived = true)
+        : ObjectRangeBase(StaticClass<T>(), includeDerived)
+    {}
+
+    struct Iterator : ObjectRangeBase::Iterator {
+        T* operator*() const { return (T*) ObjectRangeBase::Iterator::operator*(); }
+        Iterator& operator++() { ObjectRangeBase::Iterator::operator++(); return *this; }
+    };
+    Iterator begin() { return { ObjectRangeBase::begin() }; }
+};
+
+template<typename F>
+void ForEachObjectOfClass(Class* objectClass, const bool includeDerived, F&& function) {
+    for (Object* object : ObjectRangeBase(objectClass, includeDerived)) {
+        function(object);
+    }
+}
+
+template<typename T, typename F>
+void ForEachObjectOfClass(const bool includeDerived, F&& function) {
+    for (T* object : ObjectRange<T>(includeDerived)) {
+        function(object);
+    }
+}
+
+namespace Detail {
+    template<typename T>
+    bool IsObjectOfClass(const Object* object) {
+        // Nothing can derive from a final class, so only its own class needs checking
+        if constexpr (std::is_final_v<T>) {
+            return object->GetClass() == StaticClass<T>();
+        } else {
+            return object->GetClass()->IsDerivedFrom<T>();
+        }
+    }
+}
+
 template<typename T>
 const T* Cast(const Object* object) {
     static_assert(IsDerivedFrom<T, Object>, "T must be an object to cast an object to it");
-    if (object && object->GetClass()->IsDerivedFrom<T>()) {
-        return static_cast<T*>(object);
+    if (object && Detail::IsObjectOfClass<T>(object)) {
+        return static_cast<const T*>(object);
     }
     return nullptr;
 }
@@ -325,7 +620,7 @@ const T* Cast(const Object* object) {
 template<typename T>
 T* Cast(Object* object) {
     static_assert(IsDerivedFrom<T, Object>, "T must be an object to cast an object to it");
-    if (object && object->GetClass()->IsDerivedFrom<T>()) {
+    if (object && Detail::IsObjectOfClass<T>(object)) {
         return static_cast<T*>(object);
     }
     return nullptr;
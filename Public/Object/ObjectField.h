@@ -2,12 +2,13 @@
 
 #include "Object/Types.h"
 #include "Object/TypeTraits.h"
+#include "Object/InternedString.h"
 
 struct Class;
 struct Enum;
 struct Object;
 
-enum class ObjectFieldType {
+enum class ObjectFieldType : u8 {
     Boolean,
     Int32,
     Int64,
@@ -22,20 +23,44 @@ enum class ObjectFieldType {
 struct ObjectField {
     ObjectFieldType Type;
     u32 Offset;
-    String Name;
+    InternedString Name;
 
     ObjectField(ObjectFieldType type, u32 offset, const String& name);
     ObjectField(ObjectFieldType type, u32 offset, String&& name);
 
-    bool HasTag(const String& tag) const;
-    const String& GetTag(const String& tag) const;
-    ObjectField* WithTag(const String& tag, const String& value);
-    ObjectField* WithTag(String&& tag, String&& value);
+    // Fields only have a few tags, so these compare the ids of each in turn. Keep an
+    // InternedString for tags looked up often, looking up by name has to find its id first.
+    // Names that have never been interned can't be tags, and aren't interned by looking
+    bool HasTag(InternedString tag) const;
+    bool HasTag(std::string_view tag) const;
+    const String& GetTag(InternedString tag) const;
+    const String& GetTag(std::string_view tag) const;
+    ObjectField* WithTag(InternedString tag, const String& value);
+    ObjectField* WithTag(InternedString tag, String&& value);
+    ObjectField* WithTag(std::string_view tag, const String& value) { return WithTag(InternedString(tag), value); }
+    ObjectField* WithTag(std::string_view tag, String&& value) { return WithTag(InternedString(tag), Move(value)); }
+    const Array<std::pair<InternedString, String>>& GetTags() const { return tags; }
 
     void* GetUntypedValuePtr(Object* object);
 
 private:
-    Map<String, String> tags;
+    Array<std::pair<InternedString, String>> tags;
+};
+
+// One entry of a class's packed field table, see Class::FieldTable. Describes the same
+// field as the class's ObjectField, without the allocations to chase through
+struct ClassField {
+    InternedString Name;
+    u32 Offset;
+    ObjectFieldType Type;
+    // What array fields hold, the same as Type for other fields
+    ObjectFieldType ElementType;
+    // The ObjectField's own tags, which are fixed once the class has registered its fields
+    u16 TagCount;
+    const std::pair<InternedString, String>* Tags;
+    // Set for object and enum fields, or arrays of them
+    Class* ObjectClass;
+    Enum* EnumType;
 };
 
 struct BoolObjectField : ObjectField {
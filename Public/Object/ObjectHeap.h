@@ -0,0 +1,52 @@
+#pragma once
+
+#include "Object/Types.h"
+
+struct Class;
+
+enum class ObjectSweepMode : u8 {
+    // Garbage is reclaimed during the collection, split between the collection threads
+    Eager,
+    // Garbage is reclaimed from a block when the allocator next needs slots from it, or at
+    // the start of the next collection. Unreachable objects are still destroyed straight
+    // away, only their destructor and freeing their memory is deferred
+    Lazy,
+};
+
+struct ObjectHeapSettings {
+    // How many blocks a pool allocates the first time it needs memory. Each time the
+    // pool grows after that it allocates twice as many, up to MaxBlocksPerGrowth
+    u32 InitialBlocksPerGrowth = 1;
+    u32 MaxBlocksPerGrowth = 32;
+    // Ask the OS to back growths of at least 2MB with transparent huge pages
+    bool UseHugePages = true;
+
+    // Blocks left empty by a sweep are only given back to the OS once they have stayed
+    // empty for this many collections, so a heap that shrinks and regrows doesn't thrash
+    u32 SweepsBeforeReleasingEmptyBlocks = 2;
+    // Each pool keeps some empty blocks around to grow into, at least this many, or this
+    // fraction of its blocks still in use, whichever is larger
+    u32 MinRetainedEmptyBlocks = 1;
+    r32 RetainedEmptyBlockRatio = 0.25f;
+
+    // Threads used by a collection, including the one calling CollectGarbage. 0 uses one
+    // per hardware thread. Small heaps use fewer, as there's not enough work to share
+    u32 CollectionThreadCount = 0;
+    // Object destructors run on whichever thread reclaims them, so they shouldn't touch
+    // anything outside of their own object
+    ObjectSweepMode SweepMode = ObjectSweepMode::Eager;
+};
+
+struct ObjectHeapStats {
+    u64 ReservedBytes = 0;
+    u64 CommittedBytes = 0;
+    u64 BlockCount = 0;
+};
+
+// Changes apply the next time a pool grows, or the next collection
+ObjectHeapSettings& GetObjectHeapSettings();
+ObjectHeapStats GetObjectHeapStats();
+
+// Overrides the growth settings of the pool objects of this class are allocated from.
+// Pools are shared by classes of a similar size, so this affects those classes too
+void SetBlocksPerGrowthForClass(Class* objectClass, u32 initialBlocksPerGrowth, u32 maxBlocksPerGrowth);
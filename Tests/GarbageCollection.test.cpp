@@ -1,7 +1,11 @@
 #include "TestObjects.h"
+#include "Object/ObjectHeap.h"
 
 #include <catch2/catch_test_macros.hpp>
 
+#include <algorithm>
+#include <chrono>
+
 TEST_CASE("Unreferenced objects should be collected", "[GC]") {
     TestReferencingObject* object = NewObject<TestReferencingObject>();
     TestReferencingObject* object2 = NewObject<TestReferencingObject>();
@@ -38,6 +42,43 @@ TEST_CASE("RootSet objects should not be collected", "[GC]") {
     REQUIRE_FALSE(IsValid(object));
 }
 
+TEST_CASE("Removing objects from the root set should keep the other roots", "[GC]") {
+    constexpr i32 objectCount = 100;
+
+    Array<TestReferencingObject*> objects;
+    for (i32 i = 0; i < objectCount; ++i) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        object->Next = nullptr;
+        object->AddToRootSet();
+        // Adding a root twice shouldn't need removing twice
+        object->AddToRootSet();
+        objects.push_back(object);
+    }
+
+    // Remove from the front, middle and back of the root set
+    for (i32 i = 0; i < objectCount; i += 3) {
+        objects[i]->RemoveFromRootSet();
+    }
+    objects[objectCount - 2]->RemoveFromRootSet();
+
+    Object::CollectGarbage();
+
+    for (i32 i = 0; i < objectCount; ++i) {
+        const bool isRoot = i % 3 != 0 && i != objectCount - 2;
+        REQUIRE(IsValid(objects[i]) == isRoot);
+    }
+
+    for (i32 i = 0; i < objectCount; ++i) {
+        if (IsValid(objects[i])) {
+            objects[i]->RemoveFromRootSet();
+        }
+    }
+    Object::CollectGarbage();
+    for (TestReferencingObject* object : objects) {
+        REQUIRE_FALSE(IsValid(object));
+    }
+}
+
 TEST_CASE("Objects referenced from the root set should not be collected", "[GC]") {
     TestReferencingObject* object = NewObject<TestReferencingObject>();
     TestReferencingObject* object2 = NewObject<TestReferencingObject>();
@@ -165,3 +206,510 @@ TEST_CASE("Pointers to destroyed objects should be nulled during destruction", "
     REQUIRE_FALSE(HasAnyFlags(objectToDestroy->GetFlags(), ObjectFlags::IsBeingDestroyed));
     REQUIRE(HasAnyFlags(objectToDestroy->GetFlags(), ObjectFlags::IsDestroyed));
 }
+
+TEST_CASE("Objects allocated into collected slots should be valid", "[GC]") {
+    Array<TestReferencingObject*> objects;
+    for (i32 index = 0; index < 256; ++index) {
+        objects.push_back(NewObject<TestReferencingObject>());
+    }
+
+    Object::CollectGarbage();
+
+    for (TestReferencingObject* object : objects) {
+        REQUIRE_FALSE(IsValid(object));
+    }
+
+    for (i32 index = 0; index < 256; ++index) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        REQUIRE(IsValid(object));
+        REQUIRE_FALSE(HasAnyFlags(object->GetFlags(), ObjectFlags::IsBeingDestroyed | ObjectFlags::IsDestroyed));
+    }
+}
+
+TEST_CASE("Objects larger than a pool block should be collected", "[GC]") {
+    TestLargeObject* object = NewObject<TestLargeObject>();
+    TestLargeObject* object2 = NewObject<TestLargeObject>();
+    TestLargeObject* object3 = NewObject<TestLargeObject>();
+
+    REQUIRE(IsValid(object));
+    REQUIRE(IsValid(object2));
+    REQUIRE(IsValid(object3));
+
+    object->AddToRootSet();
+    object->Next = object2;
+
+    Object::CollectGarbage();
+
+    REQUIRE(IsValid(object));
+    REQUIRE(IsValid(object2));
+    REQUIRE_FALSE(IsValid(object3));
+
+    object->RemoveFromRootSet();
+}
+
+TEST_CASE("Pools should grow to fit many objects", "[GC]") {
+    const ObjectHeapStats statsBefore = GetObjectHeapStats();
+    SetBlocksPerGrowthForClass(StaticClass<TestReferencingObject>(), 2, 8);
+
+    TestReferencingObject* root = NewObject<TestReferencingObject>();
+    root->AddToRootSet();
+    TestReferencingObject* last = root;
+    for (i32 index = 0; index < 20000; ++index) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        REQUIRE(object);
+        last->Next = object;
+        last = object;
+    }
+
+    const ObjectHeapStats statsAfter = GetObjectHeapStats();
+    REQUIRE(statsAfter.BlockCount > statsBefore.BlockCount);
+    REQUIRE(statsAfter.CommittedBytes > statsBefore.CommittedBytes);
+    REQUIRE(statsAfter.CommittedBytes <= statsAfter.ReservedBytes);
+
+    Object::CollectGarbage();
+
+    REQUIRE(IsValid(root));
+    REQUIRE(IsValid(last));
+
+    root->RemoveFromRootSet();
+    SetBlocksPerGrowthForClass(StaticClass<TestReferencingObject>(), 0, 0);
+}
+
+TEST_CASE("Empty pool blocks should be released after collection", "[GC]") {
+    const u64 committedBefore = GetObjectHeapStats().CommittedBytes;
+
+    for (i32 index = 0; index < 50000; ++index) {
+        REQUIRE(NewObject<TestReferencingObject>());
+    }
+
+    const u64 committedPeak = GetObjectHeapStats().CommittedBytes;
+    REQUIRE(committedPeak > committedBefore);
+
+    // Blocks are kept for a few collections in case the heap grows again
+    for (u32 collection = 0; collection <= GetObjectHeapSettings().SweepsBeforeReleasingEmptyBlocks; ++collection) {
+        Object::CollectGarbage();
+    }
+
+    REQUIRE(GetObjectHeapStats().CommittedBytes < committedPeak);
+
+    for (i32 index = 0; index < 50000; ++index) {
+        REQUIRE(IsValid(NewObject<TestReferencingObject>()));
+    }
+}
+
+TEST_CASE("Long chains of referenced objects should not be collected", "[GC]") {
+    constexpr u32 chainLength = 1000000;
+
+    TestReferencingObject* head = NewObject<TestReferencingObject>();
+    head->Next = nullptr;
+    head->AddToRootSet();
+
+    TestReferencingObject* tail = head;
+    for (u32 index = 1; index < chainLength; ++index) {
+        TestReferencingObject* next = NewObject<TestReferencingObject>();
+        next->Next = nullptr;
+        tail->Next = next;
+        tail = next;
+    }
+
+    Object::CollectGarbage();
+
+    REQUIRE(IsValid(head));
+    REQUIRE(IsValid(tail));
+
+    head->RemoveFromRootSet();
+
+    Object::CollectGarbage();
+
+    REQUIRE_FALSE(IsValid(head));
+    REQUIRE_FALSE(IsValid(tail));
+}
+
+TEST_CASE("Collecting with multiple threads should match collecting with one", "[GC]") {
+    ObjectHeapSettings& settings = GetObjectHeapSettings();
+    const u32 previousThreadCount = settings.CollectionThreadCount;
+
+    for (const u32 threadCount : { 1u, 4u }) {
+        settings.CollectionThreadCount = threadCount;
+
+        TestReferencingArrayObject* root = NewObject<TestReferencingArrayObject>();
+        root->AddToRootSet();
+
+        Array<TestReferencingObject*> reachable;
+        Array<TestReferencingObject*> unreachable;
+        for (i32 branchIndex = 0; branchIndex < 100; ++branchIndex) {
+            TestReferencingArrayObject* branch = NewObject<TestReferencingArrayObject>();
+            root->Others.push_back(branch);
+            for (i32 leafIndex = 0; leafIndex < 200; ++leafIndex) {
+                TestReferencingObject* leaf = NewObject<TestReferencingObject>();
+                leaf->Next = nullptr;
+                branch->Others.push_back(leaf);
+                reachable.push_back(leaf);
+
+                TestReferencingObject* garbage = NewObject<TestReferencingObject>();
+                garbage->Next = leaf;
+                unreachable.push_back(garbage);
+            }
+        }
+
+        TestReferencingObject* objectToDestroy = NewObject<TestReferencingObject>();
+        objectToDestroy->Next = nullptr;
+        reachable.back()->Next = objectToDestroy;
+        objectToDestroy->Destroy();
+
+        Object::CollectGarbage();
+
+        REQUIRE(IsValid(root));
+        REQUIRE(std::all_of(reachable.begin(), reachable.end(), [](TestReferencingObject* object) { return IsValid(object); }));
+        REQUIRE(std::none_of(unreachable.begin(), unreachable.end(), [](TestReferencingObject* object) { return IsValid(object); }));
+        REQUIRE(reachable.back()->Next == nullptr);
+
+        root->RemoveFromRootSet();
+        Object::CollectGarbage();
+    }
+
+    settings.CollectionThreadCount = previousThreadCount;
+}
+
+TEST_CASE("Lazily swept objects should be invalid straight after collection", "[GC]") {
+    ObjectHeapSettings& settings = GetObjectHeapSettings();
+    const ObjectSweepMode previousSweepMode = settings.SweepMode;
+    settings.SweepMode = ObjectSweepMode::Lazy;
+
+    TestReferencingObject* root = NewObject<TestReferencingObject>();
+    root->Next = nullptr;
+    root->AddToRootSet();
+
+    Array<WeakObjectPtr<TestReferencingObject>> garbage;
+    for (i32 index = 0; index < 1000; ++index) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        object->Next = nullptr;
+        garbage.emplace_back(object);
+    }
+
+    Object::CollectGarbage();
+
+    REQUIRE(IsValid(root));
+    REQUIRE(std::none_of(garbage.begin(), garbage.end(), [](const WeakObjectPtr<TestReferencingObject>& object) { return object.IsValid(); }));
+
+    // New objects are allocated from the swept slots
+    for (i32 index = 0; index < 1000; ++index) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        REQUIRE(IsValid(object));
+        object->Next = root->Next;
+        root->Next = object;
+    }
+
+    Object::CollectGarbage();
+
+    REQUIRE(IsValid(root));
+    REQUIRE(IsValid(root->Next));
+    REQUIRE(std::none_of(garbage.begin(), garbage.end(), [](const WeakObjectPtr<TestReferencingObject>& object) { return object.IsValid(); }));
+
+    root->RemoveFromRootSet();
+    Object::CollectGarbage();
+    REQUIRE_FALSE(IsValid(root));
+
+    settings.SweepMode = previousSweepMode;
+    Object::CollectGarbage();
+}
+
+TEST_CASE("Incremental collections should keep objects referenced between slices", "[GC]") {
+    TestReferencingArrayObject* root = NewObject<TestReferencingArrayObject>();
+    root->AddToRootSet();
+
+    TestReferencingObject* chain = nullptr;
+    for (i32 index = 0; index < 10000; ++index) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        object->Next = chain;
+        chain = object;
+    }
+    root->Others.push_back(chain);
+
+    TestReferencingObject* garbage = NewObject<TestReferencingObject>();
+    garbage->Next = nullptr;
+    TestReferencingObject* existingObject = NewObject<TestReferencingObject>();
+    existingObject->Next = nullptr;
+
+    // Start the collection, then reference new and existing objects from the already
+    // scanned root before finishing it
+    u32 slices = 1;
+    REQUIRE_FALSE(Object::CollectGarbageIncremental(std::chrono::microseconds(0)));
+
+    TestReferencingObject* newObject = NewObject<TestReferencingObject>();
+    newObject->Next = nullptr;
+    root->WriteBarrier(nullptr, newObject);
+    root->Others.push_back(newObject);
+    root->WriteBarrier(nullptr, existingObject);
+    root->Others.push_back(existingObject);
+
+    while (!Object::CollectGarbageIncremental(std::chrono::microseconds(0))) {
+        slices++;
+    }
+
+    REQUIRE(slices > 1);
+    REQUIRE(IsValid(root));
+    REQUIRE(IsValid(chain));
+    REQUIRE(IsValid(newObject));
+    REQUIRE(IsValid(existingObject));
+    REQUIRE_FALSE(IsValid(garbage));
+
+    root->RemoveFromRootSet();
+    Object::CollectGarbage();
+    REQUIRE_FALSE(IsValid(root));
+    REQUIRE_FALSE(IsValid(newObject));
+}
+
+TEST_CASE("Incremental collections should shade large root sets over several slices", "[GC]") {
+    Array<TestReferencingObject*> roots;
+    for (i32 index = 0; index < 10000; ++index) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        object->Next = nullptr;
+        object->AddToRootSet();
+        roots.push_back(object);
+    }
+
+    // The first slice stops part way through the roots, which then change before the next
+    REQUIRE_FALSE(Object::CollectGarbageIncremental(std::chrono::microseconds(0)));
+    for (i32 index = 0; index < 100; ++index) {
+        roots[index]->RemoveFromRootSet();
+    }
+    TestReferencingObject* newRoot = NewObject<TestReferencingObject>();
+    newRoot->Next = nullptr;
+    newRoot->AddToRootSet();
+
+    u32 slices = 1;
+    while (!Object::CollectGarbageIncremental(std::chrono::microseconds(0))) {
+        slices++;
+    }
+
+    REQUIRE(slices > 1);
+    REQUIRE(IsValid(newRoot));
+    for (i32 index = 100; index < 10000; ++index) {
+        REQUIRE(IsValid(roots[index]));
+    }
+
+    newRoot->RemoveFromRootSet();
+    for (i32 index = 100; index < 10000; ++index) {
+        roots[index]->RemoveFromRootSet();
+    }
+    Object::CollectGarbage();
+    REQUIRE_FALSE(IsValid(newRoot));
+}
+
+TEST_CASE("Objects found through weak pointers between slices should stay valid once stored", "[GC]") {
+    TestReferencingArrayObject* root = NewObject<TestReferencingArrayObject>();
+    root->AddToRootSet();
+
+    // Unreachable objects spread over many blocks, so destroying them takes several slices
+    Array<WeakObjectPtr<TestReferencingObject>> weakObjects;
+    for (i32 index = 0; index < 20000; ++index) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        object->Next = nullptr;
+        weakObjects.emplace_back(object);
+    }
+
+    // Between every slice, store the next object that can still be found, whatever phase
+    // the collection is in
+    Array<ObjectHandle> storedHandles;
+    usize weakIndex = 0;
+    bool isFinished = false;
+    while (!isFinished) {
+        isFinished = Object::CollectGarbageIncremental(std::chrono::microseconds(0));
+        for (; weakIndex < weakObjects.size(); ++weakIndex) {
+            if (TestReferencingObject* object = weakObjects[weakIndex].Get()) {
+                root->WriteBarrier(nullptr, object);
+                root->Others.push_back(object);
+                storedHandles.push_back(GetObjectHandle(object));
+                ++weakIndex;
+                break;
+            }
+        }
+    }
+
+    // Slots of collected objects are reused by new ones
+    for (i32 index = 0; index < 20000; ++index) {
+        NewObject<TestReferencingObject>()->Next = nullptr;
+    }
+    for (usize index = 0; index < root->Others.size(); ++index) {
+        REQUIRE(ResolveObjectHandle(storedHandles[index]) == root->Others[index]);
+    }
+    // Only the stored objects are left
+    usize validCount = 0;
+    for (WeakObjectPtr<TestReferencingObject>& weakObject : weakObjects) {
+        validCount += weakObject.IsValid() ? 1 : 0;
+    }
+    REQUIRE(validCount == root->Others.size());
+
+    root->RemoveFromRootSet();
+    Object::CollectGarbage();
+}
+
+TEST_CASE("Young collections should only collect objects allocated since the last collection", "[GC]") {
+    TestReferencingObject* root = NewObject<TestReferencingObject>();
+    TestReferencingObject* oldObject = NewObject<TestReferencingObject>();
+    root->Next = oldObject;
+    oldObject->Next = nullptr;
+    root->AddToRootSet();
+
+    Object::CollectYoungGarbage();
+
+    REQUIRE(IsValid(root));
+    REQUIRE(IsValid(oldObject));
+
+    // The old object is now unreferenced, but only a full collection should find that
+    TestReferencingObject* youngObject = NewObject<TestReferencingObject>();
+    TestReferencingObject* otherYoungObject = NewObject<TestReferencingObject>();
+    TestReferencingObject* youngGarbage = NewObject<TestReferencingObject>();
+    otherYoungObject->Next = nullptr;
+    youngObject->Next = otherYoungObject;
+    youngGarbage->Next = nullptr;
+    root->SetObjectReference(root->Next, youngObject);
+
+    Object::CollectYoungGarbage();
+
+    REQUIRE(IsValid(root));
+    REQUIRE(IsValid(oldObject));
+    REQUIRE(IsValid(youngObject));
+    REQUIRE(IsValid(otherYoungObject));
+    REQUIRE_FALSE(IsValid(youngGarbage));
+
+    Object::CollectGarbage();
+
+    REQUIRE(IsValid(root));
+    REQUIRE_FALSE(IsValid(oldObject));
+    REQUIRE(IsValid(youngObject));
+    REQUIRE(IsValid(otherYoungObject));
+
+    root->RemoveFromRootSet();
+    Object::CollectGarbage();
+    REQUIRE_FALSE(IsValid(root));
+}
+
+TEST_CASE("Marks from earlier collections should not keep objects alive", "[GC]") {
+    TestReferencingObject* root = NewObject<TestReferencingObject>();
+    root->Next = nullptr;
+    root->AddToRootSet();
+    // The first young collection is a full one, which starts remembering references
+    Object::CollectYoungGarbage();
+
+    // Each collection's marks should only hold the objects reachable at that point
+    TestReferencingObject* previous = nullptr;
+    for (i32 i = 0; i < 10; ++i) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        object->Next = nullptr;
+        root->SetObjectReference(root->Next, object);
+
+        Object::CollectGarbage();
+
+        REQUIRE(IsValid(object));
+        if (previous) {
+            REQUIRE_FALSE(IsValid(previous));
+        }
+        previous = object;
+    }
+
+    root->SetObjectReference(root->Next, (TestReferencingObject*) nullptr);
+    Object::CollectYoungGarbage();
+    REQUIRE(IsValid(previous));
+
+    Object::CollectGarbage();
+    REQUIRE_FALSE(IsValid(previous));
+
+    root->RemoveFromRootSet();
+    Object::CollectGarbage();
+    REQUIRE_FALSE(IsValid(root));
+}
+
+TEST_CASE("Concurrent collections should keep objects moved while marking", "[GC]") {
+    constexpr i32 holderCount = 1000;
+
+    TestReferencingArrayObject* root = NewObject<TestReferencingArrayObject>();
+    root->AddToRootSet();
+
+    Array<TestReferencingObject*> holders;
+    Array<TestReferencingObject*> leaves;
+    for (i32 index = 0; index < holderCount; ++index) {
+        TestReferencingObject* holder = NewObject<TestReferencingObject>();
+        TestReferencingObject* leaf = NewObject<TestReferencingObject>();
+        leaf->Next = nullptr;
+        holder->Next = leaf;
+        root->Others.push_back(holder);
+        holders.push_back(holder);
+        leaves.push_back(leaf);
+    }
+
+    // Give the marker plenty to do
+    TestReferencingObject* chain = nullptr;
+    for (i32 index = 0; index < 100000; ++index) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        object->Next = chain;
+        chain = object;
+    }
+    root->Others.push_back(chain);
+
+    TestReferencingObject* garbage = NewObject<TestReferencingObject>();
+    garbage->Next = nullptr;
+
+    REQUIRE_FALSE(Object::CollectGarbageConcurrent());
+
+    // Swap leaves between holders while the marker runs, so some are only ever
+    // referenced from holders it has already scanned
+    i32 swaps = 0;
+    do {
+        TestReferencingObject* first = holders[(swaps * 7) % holderCount];
+        TestReferencingObject* second = holders[(swaps * 13 + 1) % holderCount];
+        Object* firstNext = first->Next;
+        first->SetObjectReference(first->Next, second->Next);
+        second->SetObjectReference(second->Next, firstNext);
+        swaps++;
+    } while (!Object::CollectGarbageConcurrent());
+
+    REQUIRE(IsValid(root));
+    REQUIRE(IsValid(chain));
+    REQUIRE(std::all_of(leaves.begin(), leaves.end(), [](TestReferencingObject* leaf) { return IsValid(leaf); }));
+    REQUIRE_FALSE(IsValid(garbage));
+
+    root->RemoveFromRootSet();
+    Object::CollectGarbage();
+    REQUIRE_FALSE(IsValid(root));
+}
+
+TEST_CASE("Concurrent collections should only remove references to destroyed objects once marking is done", "[GC]") {
+    TestReferencingArrayObject* root = NewObject<TestReferencingArrayObject>();
+    root->AddToRootSet();
+
+    TestReferencingObject* destroyedObject = NewObject<TestReferencingObject>();
+    destroyedObject->Next = nullptr;
+    Array<TestReferencingObject*> holders;
+    for (i32 index = 0; index < 1000; ++index) {
+        TestReferencingObject* holder = NewObject<TestReferencingObject>();
+        holder->Next = destroyedObject;
+        root->Others.push_back(holder);
+        holders.push_back(holder);
+    }
+    destroyedObject->Destroy();
+
+    TestReferencingObject* chain = nullptr;
+    for (i32 index = 0; index < 100000; ++index) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        object->Next = chain;
+        chain = object;
+    }
+    root->Others.push_back(chain);
+
+    // The holders are read while the marker scans them
+    REQUIRE_FALSE(Object::CollectGarbageConcurrent());
+    usize referencesSeen = 0;
+    do {
+        for (TestReferencingObject* holder : holders) {
+            referencesSeen += holder->Next != nullptr;
+        }
+    } while (!Object::CollectGarbageConcurrent());
+
+    REQUIRE(referencesSeen > 0);
+    REQUIRE(std::all_of(holders.begin(), holders.end(), [](TestReferencingObject* holder) { return holder->Next == nullptr; }));
+
+    root->RemoveFromRootSet();
+    Object::CollectGarbage();
+}
@@ -2,6 +2,12 @@
 
 #include <catch2/catch_test_macros.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
 TEST_CASE("Static type info should be correct", "[object]") {
     REQUIRE(StaticClass<TestObject>()->Name() == "TestObject");
 }
@@ -97,6 +103,27 @@ TEST_CASE("Object class info for derived classes should be correct", "[object]")
     REQUIRE_FALSE(StaticClass<TestDerivedObject>()->IsDerivedFrom<TestReferencingArrayObject>());
 }
 
+TEST_CASE("Objects should only cast to classes they derive from", "[object]") {
+    REQUIRE(StaticClass<Object>()->Depth() == 0);
+    REQUIRE(StaticClass<TestReferencingObject>()->Depth() == 1);
+    REQUIRE(StaticClass<TestDerivedObject>()->Depth() == 2);
+    REQUIRE_FALSE(StaticClass<TestReferencingObject>()->IsDerivedFrom<TestDerivedObject>());
+    REQUIRE_FALSE(StaticClass<TestDerivedObject>()->IsDerivedFrom(nullptr));
+
+    Object* derivedObject = NewObject<TestDerivedObject>();
+    REQUIRE(Cast<TestDerivedObject>(derivedObject) == derivedObject);
+    REQUIRE(Cast<TestReferencingObject>(derivedObject) == derivedObject);
+    REQUIRE(Cast<Object>(derivedObject) == derivedObject);
+    REQUIRE(Cast<TestReferencingArrayObject>(derivedObject) == nullptr);
+    REQUIRE(Cast<TestFinalObject>(derivedObject) == nullptr);
+
+    const Object* finalObject = NewObject<TestFinalObject>();
+    REQUIRE(Cast<TestFinalObject>(finalObject) == finalObject);
+    REQUIRE(Cast<TestObject>(finalObject) == finalObject);
+    REQUIRE(Cast<TestFinalObject>((const Object*) NewObject<TestObject>()) == nullptr);
+    REQUIRE(Cast<TestFinalObject>((Object*) nullptr) == nullptr);
+}
+
 TEST_CASE("Enum info should be correct", "[object]") {
     REQUIRE(StaticEnum<TestEnum>()->Name() == "TestEnum");
     REQUIRE(StaticEnum<TestEnum>()->IsEnumFlags());
@@ -111,6 +138,31 @@ TEST_CASE("Enum info should be correct", "[object]") {
     REQUIRE(StaticEnum<TestEnum>()->FromString("SECONDENUMERATOR") == static_cast<i32>(TestEnum::SecondEnumerator));
 }
 
+TEST_CASE("Enum string conversion should handle unknown values and string views", "[object]") {
+    const Enum* testEnum = StaticEnum<TestEnum>();
+    REQUIRE(testEnum->ToString(1) == "UNKNOWN_ENUMERATOR_VALUE");
+    REQUIRE(testEnum->FromString(std::string_view("firstEnumerator")) == static_cast<i32>(TestEnum::FirstEnumerator));
+    REQUIRE(testEnum->FromString(std::string_view("SecondEnumeratorX").substr(0, 16)) == static_cast<i32>(TestEnum::SecondEnumerator));
+    REQUIRE(testEnum->FromString("Second") == -1);
+    REQUIRE(testEnum->FromString("") == -1);
+}
+
+TEST_CASE("Flags enums should convert combined values to and from strings", "[object]") {
+    const Enum* flagsEnum = StaticEnum<TestFlagsEnum>();
+    const i32 redBlue = static_cast<i32>(TestFlagsEnum::Red | TestFlagsEnum::Blue);
+    REQUIRE(flagsEnum->FlagsToString(redBlue) == "Red|Blue");
+    REQUIRE(flagsEnum->FlagsToString(static_cast<i32>(TestFlagsEnum::Green)) == "Green");
+    REQUIRE(flagsEnum->FlagsToString(0) == "None");
+    REQUIRE(flagsEnum->FlagsToString(1 << 4) == "UNKNOWN_ENUMERATOR_VALUE");
+
+    REQUIRE(flagsEnum->FlagsFromString("Red|Blue") == redBlue);
+    REQUIRE(flagsEnum->FlagsFromString(" blue | RED ") == redBlue);
+    REQUIRE(flagsEnum->FlagsFromString("Green") == static_cast<i32>(TestFlagsEnum::Green));
+    REQUIRE(flagsEnum->FlagsFromString("") == 0);
+    REQUIRE(flagsEnum->FlagsFromString("Red|Purple") == -1);
+    REQUIRE(flagsEnum->FlagsFromString("Red||Blue") == -1);
+}
+
 TEST_CASE("Object class info should be able to find derived classes", "[object]") {
     Array<Class*> derivedClasses = StaticClass<TestReferencingObject>()->GetDerivedClasses();
     REQUIRE(derivedClasses.size() == 1);
@@ -119,6 +171,23 @@ TEST_CASE("Object class info should be able to find derived classes", "[object]"
     }
 }
 
+TEST_CASE("Classes should be found by name", "[object]") {
+    REQUIRE(Class::FindClass("TestDerivedObject") == StaticClass<TestDerivedObject>());
+    REQUIRE(Class::FindClass("Object") == StaticClass<Object>());
+    REQUIRE(Class::FindClass("NotAClass") == nullptr);
+    REQUIRE(InternedString::Find("NotAClass").IsEmpty());
+    REQUIRE(Class::FindClass(String("TestDerivedObject")) == StaticClass<TestDerivedObject>());
+
+    // Children are only the direct subclasses, derived classes include all of theirs
+    const Array<Class*> childClasses = StaticClass<TestObject>()->GetChildClasses();
+    REQUIRE(std::find(childClasses.begin(), childClasses.end(), StaticClass<TestFinalObject>()) != childClasses.end());
+    const Array<Class*> objectChildClasses = StaticClass<Object>()->GetChildClasses();
+    REQUIRE(std::find(objectChildClasses.begin(), objectChildClasses.end(), StaticClass<TestDerivedObject>()) == objectChildClasses.end());
+    const Array<Class*> objectDerivedClasses = StaticClass<Object>()->GetDerivedClasses();
+    REQUIRE(std::find(objectDerivedClasses.begin(), objectDerivedClasses.end(), StaticClass<TestDerivedObject>()) != objectDerivedClasses.end());
+    REQUIRE(StaticClass<TestDerivedObject>()->GetDerivedClasses().empty());
+}
+
 TEST_CASE("Object fields should maintain tags", "[object]") {
     const Array<UniquePtr<ObjectField>>& fields = StaticClass<TestObject>()->Fields();
 
@@ -134,4 +203,405 @@ TEST_CASE("Object fields should maintain tags", "[object]") {
     REQUIRE(fields[1]->HasTag("TestTag"));
     REQUIRE(fields[1]->GetTag("TestTag") == "AnotherTestTagValue");
     REQUIRE_FALSE(fields[1]->HasTag("OtherTag"));
+
+    // Looking up tags by name doesn't intern names that aren't tags
+    REQUIRE_FALSE(fields[0]->HasTag("NeverUsedTag"));
+    REQUIRE(fields[0]->GetTag(String("NeverUsedTag")).empty());
+    REQUIRE(StaticClass<TestObject>()->GetFieldsWithTag("NeverUsedTag").empty());
+    REQUIRE(InternedString::Find("NeverUsedTag").IsEmpty());
+    REQUIRE(StaticClass<TestObject>()->GetFieldsWithTag("TestTag").size() == 2);
+}
+
+TEST_CASE("Interned strings should compare by id", "[object]") {
+    const InternedString name("SomeName");
+    REQUIRE(name == InternedString(String("SomeName")));
+    REQUIRE(name.GetId() == InternedString("SomeName").GetId());
+    REQUIRE(name.ToString() == "SomeName");
+    REQUIRE_FALSE(name == InternedString("SomeOtherName"));
+    REQUIRE(InternedString().IsEmpty());
+    REQUIRE(InternedString("").IsEmpty());
+    REQUIRE(InternedString::Find("SomeName") == name);
+    REQUIRE(InternedString::Find("NeverInterned").IsEmpty());
+
+    // Enough strings to need several chunks of the table
+    Array<InternedString> names;
+    for (i32 index = 0; index < 5000; ++index) {
+        names.emplace_back("InternedName" + std::to_string(index));
+    }
+    for (i32 index = 0; index < 5000; ++index) {
+        REQUIRE(names[index].ToString() == "InternedName" + std::to_string(index));
+        REQUIRE(InternedString::Find("InternedName" + std::to_string(index)) == names[index]);
+    }
+}
+
+TEST_CASE("Classes should know which fields carry each tag", "[object]") {
+    const InternedString testTag("TestTag");
+    const Array<ObjectField*>& testTagFields = StaticClass<TestObject>()->GetFieldsWithTag(testTag);
+    REQUIRE(testTagFields.size() == 2);
+    REQUIRE(testTagFields[0]->Name == "SomeBoolean");
+    REQUIRE(testTagFields[1]->Name == "SomeInt32");
+
+    const Array<ObjectField*>& otherTagFields = StaticClass<TestObject>()->GetFieldsWithTag("OtherTag");
+    REQUIRE(otherTagFields.size() == 1);
+    REQUIRE(otherTagFields[0]->GetTag("OtherTag") == "OtherTagValue");
+
+    REQUIRE(StaticClass<TestObject>()->GetFieldsWithTag("MissingTag").empty());
+    REQUIRE(StaticClass<TestReferencingObject>()->GetFieldsWithTag(testTag).empty());
+}
+
+TEST_CASE("Class field tables should match the class fields", "[object]") {
+    const Class* testClass = StaticClass<TestObject>();
+    const Array<ClassField>& fieldTable = testClass->FieldTable();
+    REQUIRE(fieldTable.size() == testClass->Fields().size());
+    for (usize index = 0; index < fieldTable.size(); ++index) {
+        REQUIRE(fieldTable[index].Name == testClass->Fields()[index]->Name);
+        REQUIRE(fieldTable[index].Offset == testClass->Fields()[index]->Offset);
+        REQUIRE(fieldTable[index].Type == testClass->Fields()[index]->Type);
+    }
+
+    const ClassField& booleanField = fieldTable[0];
+    REQUIRE(booleanField.ElementType == ObjectFieldType::Boolean);
+    REQUIRE(testClass->GetFieldTags(booleanField).size() == 2);
+    REQUIRE(testClass->GetFieldTags(booleanField)[1].first == "OtherTag");
+    REQUIRE(testClass->GetFieldTags(booleanField)[1].second == "OtherTagValue");
+
+    const ClassField& objectsField = fieldTable[6];
+    REQUIRE(objectsField.Type == ObjectFieldType::Array);
+    REQUIRE(objectsField.ElementType == ObjectFieldType::Object);
+    REQUIRE(objectsField.ObjectClass == StaticClass<Object>());
+    REQUIRE(testClass->GetFieldTags(objectsField).empty());
+    REQUIRE(fieldTable[8].EnumType == StaticEnum<TestEnum>());
+
+    // Inherited fields come first
+    const Array<ClassField>& derivedFieldTable = StaticClass<TestDerivedObject>()->FieldTable();
+    REQUIRE(derivedFieldTable.size() == 2);
+    REQUIRE(derivedFieldTable[0].Name == "Next");
+    REQUIRE(derivedFieldTable[1].Name == "Other");
+}
+
+TEST_CASE("Objects can be created from multiple threads", "[object]") {
+    constexpr i32 numberOfThreads = 8;
+    constexpr i32 objectsPerThread = 5000;
+
+    Array<Array<TestReferencingObject*>> objectsPerThreadIndex(numberOfThreads);
+    Array<std::thread> threads;
+    for (i32 threadIndex = 0; threadIndex < numberOfThreads; ++threadIndex) {
+        threads.emplace_back([&objects = objectsPerThreadIndex[threadIndex]] {
+            for (i32 index = 0; index < objectsPerThread; ++index) {
+                objects.push_back(NewObject<TestReferencingObject>());
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    std::unordered_set<TestReferencingObject*> uniqueObjects;
+    for (const Array<TestReferencingObject*>& objects : objectsPerThreadIndex) {
+        for (TestReferencingObject* object : objects) {
+            REQUIRE(IsValid(object));
+            REQUIRE(object->GetClass() == StaticClass<TestReferencingObject>());
+            uniqueObjects.insert(object);
+        }
+    }
+    REQUIRE(uniqueObjects.size() == numberOfThreads * objectsPerThread);
+
+    Object::CollectGarbage();
+
+    for (TestReferencingObject* object : uniqueObjects) {
+        REQUIRE_FALSE(IsValid(object));
+    }
+}
+
+TEST_CASE("Classes should know where their object references are", "[object]") {
+    auto findFieldOffset = [](const Class* objectClass, const String& name) {
+        for (const UniquePtr<ObjectField>& field : objectClass->Fields()) {
+            if (field->Name == name) {
+                return field->Offset;
+            }
+        }
+        return u32_max;
+    };
+
+    const Class* testClass = StaticClass<TestObject>();
+    REQUIRE(testClass->ObjectReferenceOffsets() == Array<u32>{ findFieldOffset(testClass, "SomeOtherObject") });
+    REQUIRE(testClass->ObjectArrayReferenceOffsets() == Array<u32>{ findFieldOffset(testClass, "SomeOtherObjects") });
+
+    const Class* derivedClass = StaticClass<TestDerivedObject>();
+    REQUIRE(derivedClass->ObjectReferenceOffsets() == Array<u32>{ findFieldOffset(derivedClass, "Next"), findFieldOffset(derivedClass, "Other") });
+    REQUIRE(derivedClass->ObjectArrayReferenceOffsets().empty());
+
+    REQUIRE_FALSE(StaticClass<TestDelayedDestroyObject>()->HasObjectReferences());
+}
+
+template<i32 Index>
+struct RegistrationBenchmarkObject : Object {
+    virtual void GetObjectFields(Array<UniquePtr<ObjectField>>& fields) const override {
+        Object::GetObjectFields(fields);
+        EXPOSE_FIELD(SomeInt32)
+            ->WithTag("BenchmarkTag", "BenchmarkTagValue");
+        EXPOSE_FIELD(SomeReal64);
+        EXPOSE_FIELD(SomeString);
+        EXPOSE_FIELD(SomeOtherObject);
+        EXPOSE_FIELD(SomeOtherObjects);
+    }
+
+    i32 SomeInt32;
+    r64 SomeReal64;
+    String SomeString;
+    Object* SomeOtherObject;
+    Array<Object*> SomeOtherObjects;
+};
+
+// Registered on demand so the benchmark can time registering them
+#define IMPL_REGISTRATION_BENCHMARK_OBJECTS(base) \
+    IMPL_OBJECT_ON_DEMAND(RegistrationBenchmarkObject<base + 0>, Object) \
+    IMPL_OBJECT_ON_DEMAND(RegistrationBenchmarkObject<base + 1>, Object) \
+    IMPL_OBJECT_ON_DEMAND(RegistrationBenchmarkObject<base + 2>, Object) \
+    IMPL_OBJECT_ON_DEMAND(RegistrationBenchmarkObject<base + 3>, Object) \
+    IMPL_OBJECT_ON_DEMAND(RegistrationBenchmarkObject<base + 4>, Object) \
+    IMPL_OBJECT_ON_DEMAND(RegistrationBenchmarkObject<base + 5>, Object) \
+    IMPL_OBJECT_ON_DEMAND(RegistrationBenchmarkObject<base + 6>, Object) \
+    IMPL_OBJECT_ON_DEMAND(RegistrationBenchmarkObject<base + 7>, Object)
+
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(0)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(8)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(16)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(24)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(32)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(40)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(48)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(56)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(64)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(72)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(80)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(88)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(96)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(104)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(112)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(120)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(128)
+IMPL_REGISTRATION_BENCHMARK_OBJECTS(136)
+
+#undef IMPL_REGISTRATION_BENCHMARK_OBJECTS
+
+template<i32 First, i32... Indices>
+Array<Class*> RegisterBenchmarkClasses(std::integer_sequence<i32, Indices...>) {
+    return { StaticClass<RegistrationBenchmarkObject<First + Indices>>()... };
+}
+
+template<i32 First, i32... Indices>
+Array<Class*> RegisterBenchmarkClassesEagerly(std::integer_sequence<i32, Indices...>) {
+    // Describing each class's fields as it registers, as startup used to
+    return { [] {
+        Class* objectClass = StaticClass<RegistrationBenchmarkObject<First + Indices>>();
+        objectClass->EnsureFieldsRegistered();
+        return objectClass;
+    }()... };
+}
+
+TEST_CASE("Class registration", "[.][benchmark]") {
+    using Clock = std::chrono::steady_clock;
+    auto microseconds = [](const Clock::duration duration) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    };
+
+    // Startup now only pays for registering, describing the fields waits until they're
+    // first needed. Each set of classes can only be registered once, so they're different
+    const Clock::time_point eagerStart = Clock::now();
+    const Array<Class*> eagerClasses = RegisterBenchmarkClassesEagerly<0>(std::make_integer_sequence<i32, 64>{});
+    const Clock::time_point eagerRegistered = Clock::now();
+
+    const Clock::time_point start = Clock::now();
+    const Array<Class*> classes = RegisterBenchmarkClasses<64>(std::make_integer_sequence<i32, 64>{});
+    const Clock::time_point registered = Clock::now();
+    for (const Class* objectClass : classes) {
+        objectClass->EnsureFieldsRegistered();
+    }
+    const Clock::time_point fieldsRegistered = Clock::now();
+
+    for (const Class* objectClass : eagerClasses) {
+        REQUIRE(objectClass->FieldTable().size() == 5);
+    }
+    for (const Class* objectClass : classes) {
+        REQUIRE(objectClass->FieldTable().size() == 5);
+    }
+    WARN("Registering " << eagerClasses.size() << " classes and describing their fields straight away took "
+        << microseconds(eagerRegistered - eagerStart) << "us");
+    WARN("Registering " << classes.size() << " classes took " << microseconds(registered - start)
+        << "us, describing their fields later took " << microseconds(fieldsRegistered - registered) << "us");
+}
+
+TEST_CASE("Classes should be registrable on demand from several threads at once", "[object]") {
+    // Registering roots each class, so the root set and the hierarchy change on every thread
+    constexpr i32 threadCount = 4;
+    Array<Array<Class*>> registeredClasses(threadCount);
+    Array<std::thread> threads;
+    threads.emplace_back([&registeredClasses] {
+        registeredClasses[0] = RegisterBenchmarkClasses<128>(std::make_integer_sequence<i32, 4>{});
+    });
+    threads.emplace_back([&registeredClasses] {
+        registeredClasses[1] = RegisterBenchmarkClasses<132>(std::make_integer_sequence<i32, 4>{});
+    });
+    threads.emplace_back([&registeredClasses] {
+        registeredClasses[2] = RegisterBenchmarkClasses<136>(std::make_integer_sequence<i32, 4>{});
+    });
+    threads.emplace_back([&registeredClasses] {
+        registeredClasses[3] = RegisterBenchmarkClasses<140>(std::make_integer_sequence<i32, 4>{});
+    });
+
+    Array<TestObject*> roots;
+    for (i32 index = 0; index < 64; ++index) {
+        roots.emplace_back(NewObject<TestObject>());
+        roots.back()->AddToRootSet();
+        REQUIRE_FALSE(StaticClass<Object>()->GetDerivedClasses().empty());
+        REQUIRE_FALSE(StaticClass<Object>()->GetChildClasses().empty());
+    }
+    for (TestObject* root : roots) {
+        root->RemoveFromRootSet();
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    const Array<Class*> derivedClasses = StaticClass<Object>()->GetDerivedClasses();
+    for (const Array<Class*>& classes : registeredClasses) {
+        for (Class* objectClass : classes) {
+            REQUIRE(std::find(derivedClasses.begin(), derivedClasses.end(), objectClass) != derivedClasses.end());
+            REQUIRE(HasAnyFlags(objectClass->GetFlags(), ObjectFlags::InRootSet));
+        }
+    }
+}
+
+TEST_CASE("Objects of a class should be iterable", "[object]") {
+    auto countObjects = [](Class* objectClass, const bool includeDerived) {
+        usize count = 0;
+        ForEachObjectOfClass(objectClass, includeDerived, [&count](Object*) { count++; });
+        return count;
+    };
+
+    Class* referencingClass = StaticClass<TestReferencingObject>();
+    const usize initialCount = countObjects(referencingClass, false);
+    const usize initialDerivedCount = countObjects(referencingClass, true);
+
+    Array<TestReferencingObject*> objects;
+    for (i32 index = 0; index < 8; ++index) {
+        objects.emplace_back(NewObject<TestReferencingObject>());
+    }
+    Array<TestDerivedObject*> derivedObjects;
+    for (i32 index = 0; index < 4; ++index) {
+        derivedObjects.emplace_back(NewObject<TestDerivedObject>());
+    }
+
+    REQUIRE(countObjects(referencingClass, false) == initialCount + 8);
+    REQUIRE(countObjects(referencingClass, true) == initialDerivedCount + 12);
+
+    std::unordered_set<Object*> visited;
+    for (TestDerivedObject* object : ObjectRange<TestDerivedObject>()) {
+        REQUIRE(visited.insert(object).second);
+    }
+    for (TestDerivedObject* object : derivedObjects) {
+        REQUIRE(visited.contains(object));
+    }
+
+    // Destroyed objects stop being visited straight away
+    objects[3]->Destroy();
+    derivedObjects[0]->Destroy();
+    REQUIRE(countObjects(referencingClass, false) == initialCount + 7);
+    REQUIRE(countObjects(referencingClass, true) == initialDerivedCount + 10);
+
+    // Objects can be destroyed and created while iterating, each object there at the start
+    // is visited once unless it's destroyed first, and new ones aren't visited
+    visited.clear();
+    ForEachObjectOfClass<TestReferencingObject>(false, [&](TestReferencingObject* object) {
+        REQUIRE(visited.insert(object).second);
+        REQUIRE(IsValid(object));
+        if (object == objects[0]) {
+            objects[7]->Destroy();
+            NewObject<TestReferencingObject>();
+        }
+    });
+    REQUIRE(!visited.contains(objects[7]));
+    REQUIRE(countObjects(referencingClass, false) == initialCount + 7);
+
+    usize visitedCount = 0;
+    for (Object* object : ObjectRangeBase(referencingClass, false)) {
+        REQUIRE(object->GetClass() == referencingClass);
+        visitedCount++;
+    }
+    REQUIRE(visitedCount == initialCount + 7);
+}
+
+TEST_CASE("Objects of a class should be iterable while other threads create and destroy them", "[object]") {
+    auto countObjects = [](Class* objectClass, const bool includeDerived) {
+        usize count = 0;
+        ForEachObjectOfClass(objectClass, includeDerived, [&count](Object*) { count++; });
+        return count;
+    };
+
+    Object::CollectGarbage();
+    Class* referencingClass = StaticClass<TestReferencingObject>();
+    Class* derivedClass = StaticClass<TestDerivedObject>();
+    const usize initialCount = countObjects(referencingClass, true);
+
+    // Ranges over the same classes nested in opposite orders on two threads, which mustn't
+    // wait on each other or on the threads creating objects
+    auto iterateNested = [](Class* outerClass, Class* innerClass) {
+        bool isEachOfItsClass = true;
+        for (i32 iteration = 0; iteration < 16; ++iteration) {
+            ForEachObjectOfClass(outerClass, false, [&isEachOfItsClass, outerClass, innerClass](Object* outerObject) {
+                isEachOfItsClass &= outerObject->GetClass() == outerClass;
+                for (Object* object : ObjectRangeBase(innerClass, false)) {
+                    isEachOfItsClass &= object->GetClass() == innerClass;
+                    break;
+                }
+            });
+        }
+        return isEachOfItsClass;
+    };
+
+    constexpr i32 threadCount = 4;
+    constexpr i32 objectsPerThread = 256;
+    Array<Array<TestDerivedObject*>> keptObjects(threadCount);
+    Array<std::thread> threads;
+    for (i32 threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+        threads.emplace_back([&keptObjects, threadIndex] {
+            for (i32 index = 0; index < objectsPerThread; ++index) {
+                TestDerivedObject* object = NewObject<TestDerivedObject>();
+                if (index % 2 == 0) {
+                    object->Destroy();
+                } else {
+                    keptObjects[threadIndex].emplace_back(object);
+                }
+            }
+        });
+    }
+    bool isEachOfItsClass = false;
+    threads.emplace_back([&iterateNested, &isEachOfItsClass, referencingClass, derivedClass] {
+        isEachOfItsClass = iterateNested(referencingClass, derivedClass);
+    });
+    REQUIRE(iterateNested(derivedClass, referencingClass));
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    REQUIRE(isEachOfItsClass);
+
+    REQUIRE(countObjects(referencingClass, true) == initialCount + threadCount * objectsPerThread / 2);
+    std::unordered_set<Object*> visited;
+    for (TestDerivedObject* object : ObjectRange<TestDerivedObject>()) {
+        visited.insert(object);
+    }
+    for (const Array<TestDerivedObject*>& objects : keptObjects) {
+        for (TestDerivedObject* object : objects) {
+            REQUIRE(visited.contains(object));
+        }
+    }
+
+    // Reclaimed objects are never visited, even once their memory is reused
+    Object::CollectGarbage();
+    REQUIRE(countObjects(referencingClass, true) == initialCount);
+    for (i32 index = 0; index < objectsPerThread; ++index) {
+        NewObject<TestObject>();
+    }
+    REQUIRE(countObjects(referencingClass, true) == initialCount);
 }
@@ -1,6 +1,10 @@
 #include "TestObjects.h"
 
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+
+#include <string>
+#include <thread>
 
 TEST_CASE("Strong object pointers prevent garbage collection", "[StrongObjectPtr]") {
     TestReferencingObject* object = NewObject<TestReferencingObject>();
@@ -109,3 +113,111 @@ TEST_CASE("Strong object pointer should be valid until object is destroyed", "[S
     REQUIRE_FALSE(strongDelayedDestroyObject.IsValid());
     REQUIRE(strongDelayedDestroyObject.Get() == nullptr);
 }
+
+TEST_CASE("Copied and moved strong object pointers should keep objects alive", "[StrongObjectPtr]") {
+    TestReferencingObject* object = NewObject<TestReferencingObject>();
+    WeakObjectPtr<TestReferencingObject> weakObject(object);
+
+    {
+        StrongObjectPtr<TestReferencingObject> strongObject(object);
+        {
+            // The copy has its own hold on the object, releasing it shouldn't release the original
+            StrongObjectPtr<TestReferencingObject> copiedObject(strongObject);
+            REQUIRE(copiedObject.Get() == object);
+        }
+        Object::CollectGarbage();
+        REQUIRE(strongObject.Get() == object);
+
+        StrongObjectPtr<TestReferencingObject> movedObject(std::move(strongObject));
+        REQUIRE(movedObject.Get() == object);
+        REQUIRE_FALSE(strongObject);
+
+        Object::CollectGarbage();
+        REQUIRE(movedObject.Get() == object);
+
+        StrongObjectPtr<TestReferencingObject> assignedObject(NewObject<TestReferencingObject>());
+        WeakObjectPtr<TestReferencingObject> weakReplacedObject(assignedObject.Get());
+        assignedObject = movedObject;
+        movedObject = std::move(assignedObject);
+        REQUIRE_FALSE(assignedObject);
+        REQUIRE(movedObject.Get() == object);
+
+        Object::CollectGarbage();
+        REQUIRE(movedObject.Get() == object);
+        REQUIRE_FALSE(weakReplacedObject);
+    }
+
+    Object::CollectGarbage();
+    REQUIRE_FALSE(weakObject);
+}
+
+TEST_CASE("Strong object pointers should be usable from several threads at once", "[StrongObjectPtr]") {
+    constexpr i32 threadCount = 8;
+    constexpr i32 objectsPerThread = 64;
+
+    Array<TestReferencingObject*> keptObjects;
+    Array<TestReferencingObject*> droppedObjects;
+    for (i32 index = 0; index < threadCount * objectsPerThread; ++index) {
+        keptObjects.push_back(NewObject<TestReferencingObject>());
+        droppedObjects.push_back(NewObject<TestReferencingObject>());
+    }
+
+    // Each thread ends up holding its share of the kept objects, after making, copying and
+    // dropping pointers to every object many times over
+    Array<Array<StrongObjectPtr<TestReferencingObject>>> heldPointers(threadCount);
+    Array<std::thread> threads;
+    for (i32 threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+        threads.emplace_back([&, threadIndex] {
+            Array<StrongObjectPtr<TestReferencingObject>>& held = heldPointers[threadIndex];
+            for (i32 iteration = 0; iteration < 200; ++iteration) {
+                for (i32 index = 0; index < objectsPerThread; ++index) {
+                    StrongObjectPtr<TestReferencingObject> dropped(droppedObjects[(index + iteration) % droppedObjects.size()]);
+                    StrongObjectPtr<TestReferencingObject> copy(dropped);
+                    StrongObjectPtr<TestReferencingObject> moved(std::move(copy));
+                }
+            }
+            for (i32 index = 0; index < objectsPerThread; ++index) {
+                held.emplace_back(keptObjects[threadIndex * objectsPerThread + index]);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    Object::CollectGarbage();
+
+    REQUIRE(std::all_of(keptObjects.begin(), keptObjects.end(), [](TestReferencingObject* object) { return IsValid(object); }));
+    REQUIRE(std::none_of(droppedObjects.begin(), droppedObjects.end(), [](TestReferencingObject* object) { return IsValid(object); }));
+}
+
+TEST_CASE("Strong object pointer registration", "[.][benchmark]") {
+    TestReferencingObject* object = NewObject<TestReferencingObject>();
+    object->AddToRootSet();
+
+    // The cost of each pointer shouldn't depend on how many others are held
+    for (const i32 heldCount : { 100, 100000 }) {
+        Array<StrongObjectPtr<TestReferencingObject>> heldObjects;
+        heldObjects.reserve(heldCount + 1);
+        for (i32 i = 0; i < heldCount; ++i) {
+            heldObjects.emplace_back(object);
+        }
+
+        BENCHMARK("Create and release with " + std::to_string(heldCount) + " held") {
+            StrongObjectPtr<TestReferencingObject> strongObject(object);
+            return strongObject.Get();
+        };
+
+        BENCHMARK("Replace the first of " + std::to_string(heldCount) + " held") {
+            heldObjects[0] = StrongObjectPtr<TestReferencingObject>(object);
+        };
+
+        BENCHMARK("Move with " + std::to_string(heldCount) + " held") {
+            heldObjects.emplace_back(std::move(heldObjects[0]));
+            heldObjects[0] = std::move(heldObjects.back());
+            heldObjects.pop_back();
+        };
+    }
+
+    object->RemoveFromRootSet();
+}
@@ -1,8 +1,11 @@
 #include "TestObjects.h"
 
 IMPL_ENUM(TestEnum);
+IMPL_ENUM(TestFlagsEnum);
 IMPL_OBJECT(TestObject, Object);
 IMPL_OBJECT(TestReferencingObject, Object);
 IMPL_OBJECT(TestReferencingArrayObject, Object);
 IMPL_OBJECT(TestDelayedDestroyObject, Object);
 IMPL_OBJECT(TestDerivedObject, TestReferencingObject);
+IMPL_OBJECT(TestFinalObject, TestObject);
+IMPL_OBJECT(TestLargeObject, Object);
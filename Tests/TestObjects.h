@@ -9,6 +9,15 @@ enum class TestEnum {
 DEFINE_ENUM_CLASS_FLAGS(TestEnum)
 DECLARE_ENUM(TestEnum)
 
+enum class TestFlagsEnum {
+    None = 0,
+    Red = 1 << 0,
+    Green = 1 << 1,
+    Blue = 1 << 2,
+};
+DEFINE_ENUM_CLASS_FLAGS(TestFlagsEnum)
+DECLARE_ENUM(TestFlagsEnum)
+
 struct TestObject : Object {
     virtual void GetObjectFields(Array<UniquePtr<ObjectField>>& fields) const override {
         Object::GetObjectFields(fields);
@@ -85,3 +94,20 @@ struct TestDerivedObject : TestReferencingObject {
 };
 
 DECLARE_OBJECT(TestDerivedObject);
+
+struct TestFinalObject final : TestObject {
+};
+
+DECLARE_OBJECT(TestFinalObject);
+
+struct TestLargeObject : Object {
+    virtual void GetObjectFields(Array<UniquePtr<ObjectField>>& fields) const override {
+        Object::GetObjectFields(fields);
+        EXPOSE_FIELD(Next);
+    }
+
+    Object* Next;
+    u8 Payload[96 * 1024];
+};
+
+DECLARE_OBJECT(TestLargeObject);
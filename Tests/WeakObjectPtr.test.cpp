@@ -1,7 +1,12 @@
 #include "TestObjects.h"
+#include "Object/ObjectHeap.h"
 
 #include <catch2/catch_test_macros.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+
 TEST_CASE("Weak object pointer should be valid until object is garbage collected", "[WeakObjectPtr]") {
     TestReferencingObject* object = NewObject<TestReferencingObject>();
     WeakObjectPtr<TestReferencingObject> weakObject(object);
@@ -53,3 +58,226 @@ TEST_CASE("Weak object pointer should be valid until object is destroyed", "[Wea
     REQUIRE_FALSE(weakDelayedDestroyObject.IsValid());
     REQUIRE(weakDelayedDestroyObject.Get() == nullptr);
 }
+
+TEST_CASE("Object handles should only resolve to the object they were made for", "[WeakObjectPtr]") {
+    static_assert(sizeof(WeakObjectPtr<TestReferencingObject>) == sizeof(ObjectHandle));
+
+    TestReferencingObject* object = NewObject<TestReferencingObject>();
+    const ObjectHandle handle = GetObjectHandle(object);
+
+    REQUIRE(handle);
+    REQUIRE(ResolveObjectHandle(handle) == object);
+    REQUIRE(GetObjectHandle(object) == handle);
+    REQUIRE(WeakObjectPtr<TestReferencingObject>(object).GetHandle() == handle);
+    REQUIRE_FALSE(GetObjectHandle(nullptr));
+    REQUIRE(ResolveObjectHandle(ObjectHandle{}) == nullptr);
+
+    Object::CollectGarbage();
+    REQUIRE(ResolveObjectHandle(handle) == nullptr);
+
+    // Objects reusing the slot get a new handle
+    Array<TestReferencingObject*> objects;
+    for (i32 i = 0; i < 100; ++i) {
+        objects.push_back(NewObject<TestReferencingObject>());
+    }
+    for (TestReferencingObject* newObject : objects) {
+        REQUIRE(GetObjectHandle(newObject) != handle);
+        REQUIRE(ResolveObjectHandle(GetObjectHandle(newObject)) == newObject);
+    }
+    REQUIRE(ResolveObjectHandle(handle) == nullptr);
+}
+
+TEST_CASE("Weak object pointers should not resolve to objects reusing released memory", "[WeakObjectPtr]") {
+    Array<WeakObjectPtr<TestReferencingObject>> weakObjects;
+    for (i32 index = 0; index < 50000; ++index) {
+        weakObjects.emplace_back(NewObject<TestReferencingObject>());
+    }
+
+    // Blocks are kept for a few collections before their memory is released
+    for (u32 collection = 0; collection <= GetObjectHeapSettings().SweepsBeforeReleasingEmptyBlocks; ++collection) {
+        Object::CollectGarbage();
+    }
+
+    // Objects of a different size come from another pool, which takes the released blocks
+    Array<TestObject*> objects;
+    for (i32 index = 0; index < 50000; ++index) {
+        objects.push_back(NewObject<TestObject>());
+    }
+
+    usize resolvedCount = 0;
+    for (WeakObjectPtr<TestReferencingObject>& weakObject : weakObjects) {
+        if (weakObject.IsValid()) {
+            resolvedCount++;
+        }
+    }
+    REQUIRE(resolvedCount == 0);
+}
+
+TEST_CASE("Pinned objects should not be collected until unpinned", "[WeakObjectPtr]") {
+    TestReferencingObject* object = NewObject<TestReferencingObject>();
+    WeakObjectPtr<TestReferencingObject> weakObject(object);
+
+    {
+        ObjectPin<TestReferencingObject> pin = weakObject.Pin();
+        REQUIRE(pin);
+        REQUIRE(pin.Get() == object);
+
+        Object::CollectGarbage();
+        REQUIRE(weakObject.Get() == object);
+
+        // Moving a pin hands it over without unpinning
+        ObjectPin<TestReferencingObject> movedPin = std::move(pin);
+        REQUIRE_FALSE(pin);
+        REQUIRE(movedPin.Get() == object);
+    }
+
+    Object::CollectGarbage();
+    REQUIRE_FALSE(weakObject);
+    REQUIRE_FALSE(weakObject.Pin());
+
+    TestReferencingObject* destroyedObject = NewObject<TestReferencingObject>();
+    WeakObjectPtr<TestReferencingObject> weakDestroyedObject(destroyedObject);
+    destroyedObject->Destroy();
+    REQUIRE_FALSE(weakDestroyedObject.Pin());
+}
+
+TEST_CASE("Objects referenced by pinned objects should not be collected", "[WeakObjectPtr]") {
+    auto collect = [](const bool incrementally) {
+        if (incrementally) {
+            while (!Object::CollectGarbageIncremental(std::chrono::microseconds(0))) {}
+        } else {
+            Object::CollectGarbage();
+        }
+    };
+
+    for (const bool incrementally : { false, true }) {
+        TestReferencingObject* object = NewObject<TestReferencingObject>();
+        TestReferencingObject* referencedObject = NewObject<TestReferencingObject>();
+        object->SetObjectReference(object->Next, referencedObject);
+        WeakObjectPtr<TestReferencingObject> weakObject(object);
+        WeakObjectPtr<TestReferencingObject> weakReferencedObject(referencedObject);
+
+        {
+            ObjectPin<TestReferencingObject> pin = weakObject.Pin();
+            collect(incrementally);
+
+            // New objects would reuse the slot of the referenced object if it had been collected
+            for (i32 index = 0; index < 1000; ++index) {
+                NewObject<TestReferencingObject>();
+            }
+            REQUIRE(weakObject.Get() == object);
+            REQUIRE(weakReferencedObject.Get() == referencedObject);
+            REQUIRE(pin->Next == referencedObject);
+
+            // Objects kept by the pin can still be pinned themselves
+            REQUIRE(weakReferencedObject.Pin());
+        }
+
+        collect(incrementally);
+        REQUIRE_FALSE(weakObject);
+        REQUIRE_FALSE(weakReferencedObject);
+    }
+}
+
+TEST_CASE("Objects should be pinnable while collecting on another thread", "[WeakObjectPtr]") {
+    constexpr i32 objectCount = 1000;
+    constexpr i32 threadCount = 4;
+
+    Array<WeakObjectPtr<TestObject>> weakObjects;
+    for (i32 i = 0; i < objectCount; ++i) {
+        TestObject* object = NewObject<TestObject>();
+        object->SomeInt32 = i;
+        if (i % 2 == 0) {
+            object->AddToRootSet();
+        }
+        weakObjects.emplace_back(object);
+    }
+
+    std::atomic<bool> isFinished = false;
+    std::atomic<i32> mismatchCount = 0;
+    Array<std::thread> threads;
+    for (i32 threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+        threads.emplace_back([&] {
+            while (!isFinished) {
+                for (i32 i = 0; i < objectCount; ++i) {
+                    const ObjectPin<TestObject> pin = weakObjects[i].Pin();
+                    if (pin && pin->SomeInt32 != i) {
+                        mismatchCount++;
+                    }
+                }
+            }
+        });
+    }
+
+    // New objects reuse the slots of collected ones, a bad pin would see their values
+    for (i32 collection = 0; collection < 10; ++collection) {
+        Object::CollectGarbage();
+        for (i32 i = 0; i < objectCount; ++i) {
+            NewObject<TestObject>()->SomeInt32 = -1;
+        }
+    }
+    isFinished = true;
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(mismatchCount == 0);
+    for (i32 i = 0; i < objectCount; i += 2) {
+        REQUIRE(weakObjects[i].Pin());
+        weakObjects[i].Get()->RemoveFromRootSet();
+    }
+    Object::CollectGarbage();
+}
+
+TEST_CASE("Objects should be pinnable while their blocks are released on another thread", "[WeakObjectPtr]") {
+    constexpr i32 objectCount = 20000;
+    constexpr i32 threadCount = 4;
+
+    Array<WeakObjectPtr<TestObject>> weakObjects;
+    for (i32 i = 0; i < objectCount; ++i) {
+        TestObject* object = NewObject<TestObject>();
+        object->SomeInt32 = i;
+        weakObjects.emplace_back(object);
+    }
+
+    std::atomic<bool> isFinished = false;
+    std::atomic<i32> mismatchCount = 0;
+    Array<std::thread> threads;
+    for (i32 threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+        threads.emplace_back([&] {
+            while (!isFinished) {
+                for (i32 i = 0; i < objectCount; ++i) {
+                    const ObjectPin<TestObject> pin = weakObjects[i].Pin();
+                    if (pin && pin->SomeInt32 != i) {
+                        mismatchCount++;
+                    }
+                }
+            }
+        });
+    }
+
+    // Blocks are kept for a few collections before their memory is released, then objects
+    // of a different size take it over while the other threads are still pinning
+    Array<WeakObjectPtr<TestReferencingObject>> reusingObjects;
+    for (u32 collection = 0; collection <= GetObjectHeapSettings().SweepsBeforeReleasingEmptyBlocks + 2; ++collection) {
+        Object::CollectGarbage();
+        for (i32 i = 0; i < objectCount; ++i) {
+            reusingObjects.emplace_back(NewObject<TestReferencingObject>());
+        }
+    }
+    isFinished = true;
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(mismatchCount == 0);
+    // A pin that landed in the reused memory would keep one of these around
+    Object::CollectGarbage();
+    usize validCount = 0;
+    for (const WeakObjectPtr<TestReferencingObject>& reusingObject : reusingObjects) {
+        if (reusingObject.IsValid()) {
+            validCount++;
+        }
+    }
+    REQUIRE(validCount == 0);
+}